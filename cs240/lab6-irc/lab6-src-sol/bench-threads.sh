@@ -0,0 +1,40 @@
+#!/bin/bash
+
+if [ $# -lt 1 ]
+then
+  echo "Usage: `basename $0` port [max-threads [clients [seconds]]]"
+  exit 1
+fi
+
+PORT=$1
+MAXTHREADS=${2:-`nproc`}
+CLIENTS=${3:-64}
+SECONDS_PER_RUN=${4:-5}
+SERVER=`pwd`/talk-server
+
+# Run the servers in a scratch directory so that the password file of the
+# tests is left alone
+DIR=`mktemp -d`
+trap "rm -rf $DIR" EXIT
+
+echo "SEND-MESSAGE requests/s with $CLIENTS clients, 1 to $MAXTHREADS threads"
+for (( t = 1; t <= MAXTHREADS; t++ ))
+do
+  rm -f $DIR/password.*
+  (cd $DIR && exec $SERVER -t $t $PORT > /dev/null) &
+  PID=$!
+  sleep 1
+
+  ./test-talk-server localhost $PORT "ADD-USER bench bench" > /dev/null
+  # Send the session token, not the password, as clients would
+  TOKEN=`./test-talk-server localhost $PORT "LOGIN bench bench" | sed -n 's/^OK //p' | tr -d '\r'`
+  ./test-talk-server localhost $PORT "ENTER-ROOM bench $TOKEN" > /dev/null
+  echo "== $t server threads"
+  ./test-talk-server -c $CLIENTS -j $MAXTHREADS -s $SECONDS_PER_RUN localhost $PORT \
+    "SEND-MESSAGE bench $TOKEN hello"
+
+  kill -9 $PID
+  wait $PID 2> /dev/null
+done
+
+exit 0
@@ -125,31 +125,31 @@ processTimeRequest( int fd )
   const char * prompt = "\nType your name:";
   write( fd, prompt, strlen( prompt ) );
 
-  // Currently character read
-  unsigned char newChar;
-
-  // Last character read
-  unsigned char lastChar = 0;
-
   //
   // The client should send <name><cr><lf>
-  // Read the name of the client character by character until a
-  // <CR><LF> is found.
+  // Read the name in chunks until a <CR><LF> is found, looking for it
+  // only in the bytes just received.
   //
-    
-  while ( nameLength < MaxName &&
-	  ( n = read( fd, &newChar, sizeof(newChar) ) ) > 0 ) {
-
-    if ( lastChar == '\015' && newChar == '\012' ) {
-      // Discard previous <CR> from name
-      nameLength--;
-      break;
-    }
 
-    name[ nameLength ] = newChar;
-    nameLength++;
-
-    lastChar = newChar;
+  bool found = false;
+  while ( !found && nameLength < MaxName &&
+	  ( n = read( fd, name + nameLength, MaxName - nameLength ) ) > 0 ) {
+
+    // A <CR> received at the end of the previous chunk may start <CR><LF>
+    int from = nameLength > 0 ? nameLength - 1 : 0;
+    nameLength += n;
+
+    char * p = name + from;
+    char * end = name + nameLength;
+    while ( ( p = (char *) memchr( p, '\015', end - p ) ) != NULL ) {
+      if ( p + 1 < end && p[ 1 ] == '\012' ) {
+	// Discard <CR><LF> and anything sent after it
+	nameLength = p - name;
+	found = true;
+	break;
+      }
+      p++;
+    }
   }
 
   // Add null character at the end of the string
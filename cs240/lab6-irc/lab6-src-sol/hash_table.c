@@ -0,0 +1,216 @@
+#include <stdlib.h>
+#include <string.h>
+#include "hash_table.h"
+
+#define HTABLE_INITIAL_BUCKETS 64
+
+//
+// FNV-1a hash of the key. Unlike summing the characters, it spreads
+// similar keys (user1, user2, ...) over all the buckets.
+//
+static unsigned int htable_hash(const char * key) {
+	unsigned int h = 2166136261u;
+	const unsigned char * p = (const unsigned char *) key;
+	while (*p) {
+		h ^= *p;
+		h *= 16777619u;
+		p++;
+	}
+	return h;
+}
+
+//
+// It returns a new empty HASH_TABLE, or NULL if it cannot be allocated.
+//
+HASH_TABLE * htable_create() {
+	HASH_TABLE * table = (HASH_TABLE *) malloc(sizeof(HASH_TABLE));
+	if (table == NULL) {
+		return NULL;
+	}
+
+	table->buckets = (HASH_TABLE_ENTRY **)
+		calloc(HTABLE_INITIAL_BUCKETS, sizeof(HASH_TABLE_ENTRY *));
+	if (table->buckets == NULL) {
+		free(table);
+		return NULL;
+	}
+
+	table->nElements = 0;
+	table->nBuckets = HTABLE_INITIAL_BUCKETS;
+	table->order.after = &table->order;
+	table->order.before = &table->order;
+
+	return table;
+}
+
+//
+// Frees the table and its keys. The data is not freed.
+//
+void htable_free(HASH_TABLE * table) {
+	HASH_TABLE_ENTRY * e = table->order.after;
+	while (e != &table->order) {
+		HASH_TABLE_ENTRY * after = e->after;
+		free(e->key);
+		free(e);
+		e = after;
+	}
+	free(table->buckets);
+	free(table);
+}
+
+//
+// Doubles the number of buckets once there are more entries than buckets,
+// so that chains stay short.
+//
+static void htable_grow(HASH_TABLE * table) {
+	int nBuckets = 2 * table->nBuckets;
+	HASH_TABLE_ENTRY ** buckets = (HASH_TABLE_ENTRY **)
+		calloc(nBuckets, sizeof(HASH_TABLE_ENTRY *));
+	if (buckets == NULL) {
+		// Keep the current buckets, only longer chains
+		return;
+	}
+
+	int i;
+	for (i = 0; i < table->nBuckets; i++) {
+		HASH_TABLE_ENTRY * e = table->buckets[i];
+		while (e != NULL) {
+			HASH_TABLE_ENTRY * next = e->next;
+			int h = e->hash % nBuckets;
+			e->next = buckets[h];
+			buckets[h] = e;
+			e = next;
+		}
+	}
+
+	free(table->buckets);
+	table->buckets = buckets;
+	table->nBuckets = nBuckets;
+}
+
+static HASH_TABLE_ENTRY * htable_find_entry(HASH_TABLE * table,
+					    const char * key, unsigned int hash) {
+	HASH_TABLE_ENTRY * e = table->buckets[hash % table->nBuckets];
+	while (e != NULL) {
+		if (e->hash == hash && !strcmp(e->key, key)) {
+			return e;
+		}
+		e = e->next;
+	}
+	return NULL;
+}
+
+//
+// Adds a key/data pair. The key is duplicated with strdup(), the data is
+// stored as is. If the key already exists its data is substituted and 1
+// is returned; otherwise it returns 0 (or -1 if out of memory).
+//
+int htable_insert(HASH_TABLE * table, const char * key, void * data) {
+	unsigned int hash = htable_hash(key);
+	HASH_TABLE_ENTRY * e = htable_find_entry(table, key, hash);
+	if (e != NULL) {
+		e->data = data;
+		return 1;
+	}
+
+	if (table->nElements >= table->nBuckets) {
+		htable_grow(table);
+	}
+
+	e = (HASH_TABLE_ENTRY *) malloc(sizeof(HASH_TABLE_ENTRY));
+	if (e == NULL) {
+		return -1;
+	}
+	e->key = strdup(key);
+	if (e->key == NULL) {
+		free(e);
+		return -1;
+	}
+	e->data = data;
+	e->hash = hash;
+
+	int h = hash % table->nBuckets;
+	e->next = table->buckets[h];
+	table->buckets[h] = e;
+
+	// Add at the end of the insertion order
+	e->after = &table->order;
+	e->before = table->order.before;
+	table->order.before->after = e;
+	table->order.before = e;
+
+	table->nElements++;
+	return 0;
+}
+
+//
+// Finds a key, and places its data in *data (if data is not NULL).
+// Returns 1 if the key exists or 0 otherwise.
+//
+int htable_find(HASH_TABLE * table, const char * key, void ** data) {
+	HASH_TABLE_ENTRY * e = htable_find_entry(table, key, htable_hash(key));
+	if (e == NULL) {
+		return 0;
+	}
+	if (data != NULL) {
+		*data = e->data;
+	}
+	return 1;
+}
+
+//
+// Removes a key. Its data is not freed. Returns 1 if the key existed or
+// 0 otherwise.
+//
+int htable_remove(HASH_TABLE * table, const char * key) {
+	unsigned int hash = htable_hash(key);
+	HASH_TABLE_ENTRY ** link = &table->buckets[hash % table->nBuckets];
+	while (*link != NULL) {
+		HASH_TABLE_ENTRY * e = *link;
+		if (e->hash == hash && !strcmp(e->key, key)) {
+			*link = e->next;
+			e->before->after = e->after;
+			e->after->before = e->before;
+			free(e->key);
+			free(e);
+			table->nElements--;
+			return 1;
+		}
+		link = &e->next;
+	}
+	return 0;
+}
+
+//
+// It returns the key of the oldest entry and places its data in *data
+// (if data is not NULL), or returns NULL if the table is empty.
+//
+const char * htable_first(HASH_TABLE * table, void ** data) {
+	HASH_TABLE_ENTRY * e = table->order.after;
+	if (e == &table->order) {
+		return NULL;
+	}
+	if (data != NULL) {
+		*data = e->data;
+	}
+	return e->key;
+}
+
+//
+// Calls func(key, data, arg) for every entry, in insertion order. func
+// must not add or remove entries.
+//
+void htable_visit(HASH_TABLE * table, HTABLE_VISIT_FUNC func, void * arg) {
+	HASH_TABLE_ENTRY * e = table->order.after;
+	while (e != &table->order) {
+		(*func)(e->key, e->data, arg);
+		e = e->after;
+	}
+}
+
+//
+// It returns the number of entries in the table.
+//
+int htable_number_elements(HASH_TABLE * table) {
+	return table->nElements;
+}
@@ -0,0 +1,38 @@
+#if !defined HASH_TABLE_H
+#define HASH_TABLE_H
+
+//
+// Hash table that maps string keys to void * data. It is the C version
+// of HashTableVoid, with two additions: the buckets grow with the number
+// of entries, and the entries are also kept in insertion order so that
+// they can be listed in the order in which they were added.
+//
+
+typedef struct HASH_TABLE_ENTRY {
+	char * key;
+	void * data;
+	unsigned int hash;
+	struct HASH_TABLE_ENTRY * next;		// next entry in the bucket
+	struct HASH_TABLE_ENTRY * after;	// insertion order
+	struct HASH_TABLE_ENTRY * before;
+} HASH_TABLE_ENTRY;
+
+typedef struct HASH_TABLE {
+	int nElements;
+	int nBuckets;
+	HASH_TABLE_ENTRY ** buckets;
+	HASH_TABLE_ENTRY order;			// sentinel of the insertion order
+} HASH_TABLE;
+
+typedef void (*HTABLE_VISIT_FUNC)(const char * key, void * data, void * arg);
+
+HASH_TABLE * htable_create();
+void htable_free(HASH_TABLE * table);
+int htable_insert(HASH_TABLE * table, const char * key, void * data);
+int htable_find(HASH_TABLE * table, const char * key, void ** data);
+int htable_remove(HASH_TABLE * table, const char * key);
+const char * htable_first(HASH_TABLE * table, void ** data);
+void htable_visit(HASH_TABLE * table, HTABLE_VISIT_FUNC func, void * arg);
+int htable_number_elements(HASH_TABLE * table);
+
+#endif
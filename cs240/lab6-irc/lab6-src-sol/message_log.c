@@ -0,0 +1,660 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "message_log.h"
+
+//
+// It returns a new empty MESSAGE_LOG, or NULL if it cannot be allocated.
+//
+MESSAGE_LOG * mlog_create(int maxMessages, long maxBytes) {
+	MESSAGE_LOG * log = (MESSAGE_LOG *) calloc(1, sizeof(MESSAGE_LOG));
+	if (log == NULL) {
+		return NULL;
+	}
+	log->firstNum = 1;
+	log->nextNum = 1;
+	log->maxMessages = maxMessages;
+	log->maxBytes = maxBytes;
+	return log;
+}
+
+// Path of a file of the segment that starts at firstNum, in memory from
+// malloc()
+static char * mlog_file_name(MESSAGE_LOG * log, int firstNum,
+			     const char * extension) {
+	char * name = (char *) malloc(strlen(log->directory) + 32);
+	if (name != NULL) {
+		sprintf(name, "%s/%010d.%s", log->directory, firstNum, extension);
+	}
+	return name;
+}
+
+static void mlog_remove_files(MESSAGE_LOG * log, int firstNum) {
+	const char * extensions[] = { "log", "idx" };
+	int i;
+	for (i = 0; i < 2; i++) {
+		char * name = mlog_file_name(log, firstNum, extensions[i]);
+		if (name != NULL) {
+			unlink(name);
+			free(name);
+		}
+	}
+}
+
+// Only the files are kept once no more lines are added, so that a log
+// holds neither two files nor a mapping per segment. The lines not
+// synced yet are synced, and the .log file is cut down to them.
+static void mlog_seal(MESSAGE_SEGMENT * segment) {
+	if (segment->dataFd < 0) {
+		return;
+	}
+	if (segment->unsynced &&
+	    msync(segment->text, segment->textLength, MS_SYNC) < 0) {
+		perror("mlog_seal");
+	}
+	if (ftruncate(segment->dataFd, segment->textLength) < 0) {
+		perror("mlog_seal");
+	}
+	if (segment->unsynced && (fdatasync(segment->dataFd) < 0 ||
+				  fdatasync(segment->indexFd) < 0)) {
+		perror("mlog_seal");
+	}
+	munmap(segment->text, segment->mapLength);
+	segment->text = NULL;
+	segment->unsynced = 0;
+	close(segment->dataFd);
+	close(segment->indexFd);
+	segment->dataFd = -1;
+	segment->indexFd = -1;
+}
+
+// Whether the segment is sealed and mapped again to be read
+static int mlog_is_remapped(MESSAGE_SEGMENT * segment) {
+	return segment->mapped && segment->dataFd < 0 && segment->text != NULL;
+}
+
+static void mlog_unmap(MESSAGE_LOG * log, MESSAGE_SEGMENT * segment) {
+	if (mlog_is_remapped(segment)) {
+		munmap(segment->text, segment->mapLength);
+		segment->text = NULL;
+		log->nMapped--;
+	}
+}
+
+static void mlog_free_segment(MESSAGE_SEGMENT * segment) {
+	if (segment->mapped) {
+		if (segment->text != NULL) {
+			munmap(segment->text, segment->mapLength);
+		}
+	}
+	else {
+		free(segment->text);
+	}
+	if (segment->dataFd >= 0) {
+		close(segment->dataFd);
+		close(segment->indexFd);
+	}
+	free(segment);
+}
+
+//
+// Frees the log. The files of a log opened with mlog_open() are kept.
+//
+void mlog_free(MESSAGE_LOG * log) {
+	int i;
+	for (i = 0; i < log->nSegments; i++) {
+		mlog_free_segment(log->segments[i]);
+	}
+	free(log->segments);
+	free(log->directory);
+	free(log);
+}
+
+// Adds a segment at the end of the segments of the log
+static int mlog_append_segment(MESSAGE_LOG * log, MESSAGE_SEGMENT * segment) {
+	if (log->nSegments == log->maxSegments) {
+		int maxSegments = log->maxSegments == 0 ? 16 : 2 * log->maxSegments;
+		MESSAGE_SEGMENT ** segments = (MESSAGE_SEGMENT **)
+			realloc(log->segments, maxSegments * sizeof(MESSAGE_SEGMENT *));
+		if (segments == NULL) {
+			return 0;
+		}
+		log->segments = segments;
+		log->maxSegments = maxSegments;
+	}
+	log->segments[log->nSegments++] = segment;
+	return 1;
+}
+
+//
+// Opens the files of a segment and maps its .log. If create is set the
+// files are created empty, otherwise they must exist. The .log is grown
+// to MLOG_SEGMENT_BYTES only when lines are added to it.
+//
+static MESSAGE_SEGMENT * mlog_map_segment(MESSAGE_LOG * log, int firstNum,
+					  int create) {
+	MESSAGE_SEGMENT * segment =
+		(MESSAGE_SEGMENT *) calloc(1, sizeof(MESSAGE_SEGMENT));
+	char * dataName = mlog_file_name(log, firstNum, "log");
+	char * indexName = mlog_file_name(log, firstNum, "idx");
+	if (segment == NULL || dataName == NULL || indexName == NULL) {
+		goto fail;
+	}
+	segment->dataFd = -1;
+	segment->indexFd = -1;
+	segment->firstNum = firstNum;
+	segment->mapped = 1;
+	segment->mapLength = MLOG_SEGMENT_BYTES;
+	segment->textCapacity = MLOG_SEGMENT_BYTES;
+
+	int flags = O_RDWR | (create ? O_CREAT | O_TRUNC : 0);
+	segment->dataFd = open(dataName, flags, 0600);
+	segment->indexFd = open(indexName, flags | O_APPEND, 0600);
+	if (segment->dataFd < 0 || segment->indexFd < 0) {
+		goto fail;
+	}
+
+	// Pages past the end of the file are never touched
+	segment->text = (char *) mmap(NULL, MLOG_SEGMENT_BYTES,
+				      PROT_READ | PROT_WRITE, MAP_SHARED,
+				      segment->dataFd, 0);
+	if (segment->text == MAP_FAILED) {
+		segment->text = NULL;
+		goto fail;
+	}
+
+	free(dataName);
+	free(indexName);
+	return segment;
+
+fail:
+	perror(dataName != NULL ? dataName : "mlog");
+	if (segment != NULL) {
+		if (segment->dataFd >= 0) {
+			close(segment->dataFd);
+		}
+		if (segment->indexFd >= 0) {
+			close(segment->indexFd);
+		}
+		free(segment);
+	}
+	free(dataName);
+	free(indexName);
+	return NULL;
+}
+
+static MESSAGE_SEGMENT * mlog_new_segment(MESSAGE_LOG * log) {
+	MESSAGE_SEGMENT * segment;
+	if (log->directory != NULL) {
+		segment = mlog_map_segment(log, log->nextNum, 1);
+		if (segment == NULL) {
+			return NULL;
+		}
+		if (ftruncate(segment->dataFd, MLOG_SEGMENT_BYTES) < 0) {
+			perror("mlog_new_segment");
+			mlog_free_segment(segment);
+			mlog_remove_files(log, log->nextNum);
+			return NULL;
+		}
+	}
+	else {
+		segment = (MESSAGE_SEGMENT *) malloc(sizeof(MESSAGE_SEGMENT));
+		if (segment == NULL) {
+			return NULL;
+		}
+		segment->firstNum = log->nextNum;
+		segment->text = NULL;
+		segment->textLength = 0;
+		segment->textCapacity = 0;
+		segment->mapped = 0;
+		segment->mapLength = 0;
+		segment->lastVisit = 0;
+		segment->unsynced = 0;
+		segment->dataFd = -1;
+		segment->indexFd = -1;
+	}
+	segment->count = 0;
+
+	if (!mlog_append_segment(log, segment)) {
+		mlog_free_segment(segment);
+		if (log->directory != NULL) {
+			mlog_remove_files(log, log->nextNum);
+		}
+		return NULL;
+	}
+	if (log->nSegments > 1) {
+		mlog_seal(log->segments[log->nSegments - 2]);
+	}
+	return segment;
+}
+
+// Length of the line of the message at position i of the segment
+static int mlog_line_length(MESSAGE_SEGMENT * segment, int i) {
+	int end = (i + 1 < segment->count) ?
+		segment->offsets[i + 1] : segment->textLength;
+	return end - segment->offsets[i];
+}
+
+//
+// Drops the oldest messages until the limits hold again. A segment is
+// freed, and its files removed, once all its messages are dropped,
+// unless it is the one being filled.
+//
+static void mlog_trim(MESSAGE_LOG * log) {
+	while ( 1 ) {
+		while (log->nSegments > 1 &&
+		       log->firstNum == log->segments[0]->firstNum +
+		       log->segments[0]->count) {
+			MESSAGE_SEGMENT * segment = log->segments[0];
+			if (segment->mapped) {
+				mlog_remove_files(log, segment->firstNum);
+			}
+			mlog_unmap(log, segment);
+			mlog_free_segment(segment);
+			log->nSegments--;
+			memmove(log->segments, log->segments + 1,
+				log->nSegments * sizeof(MESSAGE_SEGMENT *));
+		}
+
+		if (log->firstNum == log->nextNum ||
+		    ((log->maxMessages <= 0 ||
+		      log->nextNum - log->firstNum <= log->maxMessages) &&
+		     (log->maxBytes <= 0 || log->bytes <= log->maxBytes))) {
+			return;
+		}
+
+		MESSAGE_SEGMENT * segment = log->segments[0];
+		log->bytes -= mlog_line_length(segment,
+					       log->firstNum - segment->firstNum);
+		log->firstNum++;
+	}
+}
+
+//
+// Adds a message at the end of the log. It returns its number, or 0 if
+// it cannot be allocated or saved.
+//
+int mlog_add(MESSAGE_LOG * log, const char * user, const char * message) {
+	char number[20];
+	sprintf(number, "%d", log->nextNum);
+	int length = strlen(number) + strlen(user) + strlen(message) + 4;
+	if (log->directory != NULL && length + 1 > MLOG_SEGMENT_BYTES) {
+		// It would not fit even in a new segment
+		return 0;
+	}
+
+	MESSAGE_SEGMENT * segment = NULL;
+	if (log->nSegments > 0) {
+		segment = log->segments[log->nSegments - 1];
+	}
+	if (segment == NULL || segment->count == MLOG_SEGMENT_MESSAGES ||
+	    (segment->mapped &&
+	     segment->textLength + length + 1 > segment->textCapacity)) {
+		segment = mlog_new_segment(log);
+		if (segment == NULL) {
+			return 0;
+		}
+	}
+
+	if (segment->textLength + length + 1 > segment->textCapacity) {
+		if (segment->mapped) {
+			// The .log of a loaded segment could not be grown
+			return 0;
+		}
+		int capacity = segment->textCapacity == 0 ? 4096 :
+			2 * segment->textCapacity;
+		while (capacity < segment->textLength + length + 1) {
+			capacity *= 2;
+		}
+		char * text = (char *) realloc(segment->text, capacity);
+		if (text == NULL) {
+			return 0;
+		}
+		segment->text = text;
+		segment->textCapacity = capacity;
+	}
+
+	sprintf(segment->text + segment->textLength, "%s %s %s\r\n",
+		number, user, message);
+
+	if (segment->mapped) {
+		// The line is complete once its end is in the index
+		uint32_t end = segment->textLength + length;
+		ssize_t n;
+		while ((n = write(segment->indexFd, &end, sizeof(end))) < 0 &&
+		       errno == EINTR) {
+		}
+		if (n != sizeof(end)) {
+			perror("mlog_add");
+			if (n > 0 && ftruncate(segment->indexFd,
+					       segment->count * sizeof(end)) < 0) {
+				perror("mlog_add");
+			}
+			return 0;
+		}
+	}
+
+	segment->offsets[segment->count++] = segment->textLength;
+	segment->textLength += length;
+	segment->unsynced = segment->mapped;
+	log->bytes += length;
+
+	int messageNum = log->nextNum++;
+	mlog_trim(log);
+	return messageNum;
+}
+
+//
+// Maps a sealed segment again to read its lines, unless it is mapped.
+// The sealed segments visited least recently, but not by this visit,
+// are unmapped to keep MLOG_MAPPED_SEGMENTS of them: the lines of the
+// segments a visit passed on must stay valid until the log changes.
+// Returns 0 if the segment cannot be mapped.
+//
+static int mlog_map_sealed(MESSAGE_LOG * log, MESSAGE_SEGMENT * segment) {
+	segment->lastVisit = log->visits;
+	if (!segment->mapped || segment->text != NULL) {
+		return 1;
+	}
+
+	while (log->nMapped >= MLOG_MAPPED_SEGMENTS) {
+		MESSAGE_SEGMENT * oldest = NULL;
+		int i;
+		for (i = 0; i < log->nSegments; i++) {
+			MESSAGE_SEGMENT * mapped = log->segments[i];
+			if (mlog_is_remapped(mapped) &&
+			    mapped->lastVisit != log->visits &&
+			    (oldest == NULL || mapped->lastVisit < oldest->lastVisit)) {
+				oldest = mapped;
+			}
+		}
+		if (oldest == NULL) {
+			// All visited now
+			break;
+		}
+		mlog_unmap(log, oldest);
+	}
+
+	char * name = mlog_file_name(log, segment->firstNum, "log");
+	int fd = name == NULL ? -1 : open(name, O_RDONLY);
+	void * text = MAP_FAILED;
+	if (fd >= 0) {
+		text = mmap(NULL, segment->textLength, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+	}
+	if (text == MAP_FAILED) {
+		perror(name != NULL ? name : "mlog");
+		free(name);
+		return 0;
+	}
+	free(name);
+
+	segment->text = (char *) text;
+	segment->mapLength = segment->textLength;
+	log->nMapped++;
+	return 1;
+}
+
+//
+// Calls func(lines, length, arg) with the lines of the messages numbered
+// after messageNum and up to lastNum, in order, a segment at a time. It
+// stops at the end of the first line that brings the bytes visited to
+// maxBytes (0 for no limit), so at least one line is visited. It returns
+// the number of the last message visited, or 0 if there is none.
+//
+int mlog_visit_after(MESSAGE_LOG * log, int messageNum, int lastNum,
+		     long maxBytes, MLOG_VISIT_FUNC func, void * arg) {
+	log->visits++;
+	int from = messageNum + 1;
+	if (from < log->firstNum) {
+		from = log->firstNum;
+	}
+	if (lastNum >= log->nextNum) {
+		lastNum = log->nextNum - 1;
+	}
+	if (from > lastNum) {
+		return 0;
+	}
+
+	// Segments may close before they are full, so look for the last
+	// one that starts at or before from
+	int low = 0;
+	int high = log->nSegments - 1;
+	while (low < high) {
+		int middle = (low + high + 1) / 2;
+		if (log->segments[middle]->firstNum <= from) {
+			low = middle;
+		}
+		else {
+			high = middle - 1;
+		}
+	}
+
+	long left = maxBytes > 0 ? maxBytes : -1;
+	int visited = 0;
+	int s;
+	for (s = low; s < log->nSegments && from <= lastNum && left != 0; s++) {
+		MESSAGE_SEGMENT * segment = log->segments[s];
+		if (!mlog_map_sealed(log, segment)) {
+			break;
+		}
+		int first = from - segment->firstNum;
+		int last = lastNum - segment->firstNum;
+		if (last >= segment->count) {
+			last = segment->count - 1;
+		}
+
+		// Up to the first line that ends past what is left
+		int start = segment->offsets[first];
+		int end = start + mlog_line_length(segment, first);
+		int i = first;
+		while (i < last && (left < 0 || end - start < left)) {
+			i++;
+			end += mlog_line_length(segment, i);
+		}
+
+		(*func)(segment->text + start, end - start, arg);
+		if (left > 0) {
+			left = end - start >= left ? 0 : left - (end - start);
+		}
+		from = segment->firstNum + i + 1;
+		visited = from - 1;
+	}
+
+	return visited;
+}
+
+//
+// It returns the number of messages kept in the log.
+//
+int mlog_number_messages(MESSAGE_LOG * log) {
+	return log->nextNum - log->firstNum;
+}
+
+//
+// Syncs to disk the lines added to the segment being filled since the
+// last call. The other segments were synced when they were sealed.
+//
+void mlog_sync(MESSAGE_LOG * log) {
+	if (log->nSegments == 0) {
+		return;
+	}
+	MESSAGE_SEGMENT * segment = log->segments[log->nSegments - 1];
+	if (!segment->unsynced || segment->dataFd < 0) {
+		return;
+	}
+	if (msync(segment->text, segment->textLength, MS_SYNC) < 0 ||
+	    fdatasync(segment->indexFd) < 0) {
+		perror("mlog_sync");
+		return;
+	}
+	segment->unsynced = 0;
+}
+
+//
+// Maps an existing segment and reads its index. Lines that are not
+// complete in .log, after a crash, are dropped from the index. Returns
+// the segment, or NULL if it cannot be read. *whole is set to 0 if
+// lines were dropped.
+//
+static MESSAGE_SEGMENT * mlog_load_segment(MESSAGE_LOG * log, int firstNum,
+					   int * whole) {
+	MESSAGE_SEGMENT * segment = mlog_map_segment(log, firstNum, 0);
+	if (segment == NULL) {
+		return NULL;
+	}
+
+	struct stat st;
+	uint32_t ends[ MLOG_SEGMENT_MESSAGES ];
+	ssize_t n = -1;
+	if (fstat(segment->dataFd, &st) == 0) {
+		n = pread(segment->indexFd, ends, sizeof(ends), 0);
+	}
+	if (n < 0) {
+		perror("mlog_load_segment");
+		mlog_free_segment(segment);
+		return NULL;
+	}
+
+	int indexed = n / sizeof(uint32_t);
+	uint32_t start = 0;
+	int i;
+	for (i = 0; i < indexed; i++) {
+		// A line ends after its start, within the file, with \r\n
+		if (ends[i] < start + 2 || ends[i] > (uint64_t) st.st_size ||
+		    ends[i] > MLOG_SEGMENT_BYTES ||
+		    segment->text[ends[i] - 2] != '\r' ||
+		    segment->text[ends[i] - 1] != '\n') {
+			break;
+		}
+		segment->offsets[i] = start;
+		start = ends[i];
+	}
+	segment->count = i;
+	segment->textLength = start;
+
+	*whole = i == indexed && (size_t) n == indexed * sizeof(uint32_t);
+	if (!*whole) {
+		fprintf(stderr, "%s: dropping messages from %d\n",
+			log->directory, firstNum + i);
+		if (ftruncate(segment->indexFd, i * sizeof(uint32_t)) < 0) {
+			perror("mlog_load_segment");
+		}
+	}
+	return segment;
+}
+
+static int mlog_is_index(const struct dirent * entry) {
+	const char * dot = strchr(entry->d_name, '.');
+	return dot != NULL && !strcmp(dot, ".idx");
+}
+
+//
+// It returns the log kept in directory, that is created if it does not
+// exist, or NULL on failure. The segments found are mapped one after the
+// other, and all but the last one are sealed as soon as the next one is
+// loaded. Segments after a crash, that is after a torn index or a gap
+// in the numbers, are removed. A segment that cannot be opened or mapped
+// fails the open and its files are left alone.
+//
+MESSAGE_LOG * mlog_open(const char * directory, int maxMessages, long maxBytes) {
+	MESSAGE_LOG * log = mlog_create(maxMessages, maxBytes);
+	if (log == NULL) {
+		return NULL;
+	}
+	log->directory = strdup(directory);
+	if (log->directory == NULL ||
+	    (mkdir(directory, 0700) < 0 && errno != EEXIST)) {
+		perror(directory);
+		mlog_free(log);
+		return NULL;
+	}
+
+	struct dirent ** entries;
+	int nEntries = scandir(directory, &entries, mlog_is_index, alphasort);
+	if (nEntries < 0) {
+		perror(directory);
+		mlog_free(log);
+		return NULL;
+	}
+
+	int broken = 0;
+	int failed = 0;
+	int i;
+	for (i = 0; i < nEntries && !failed; i++) {
+		int firstNum = atoi(entries[i]->d_name);
+		if (firstNum <= 0) {
+			// Not a segment
+			continue;
+		}
+		if (log->nSegments > 0 && firstNum != log->nextNum) {
+			broken = 1;
+		}
+		if (broken) {
+			fprintf(stderr, "%s: removing segment %d\n",
+				directory, firstNum);
+			mlog_remove_files(log, firstNum);
+			continue;
+		}
+
+		int whole;
+		MESSAGE_SEGMENT * segment = mlog_load_segment(log, firstNum, &whole);
+		if (segment == NULL) {
+			failed = 1;
+		}
+		else if (segment->count == 0) {
+			// Created just before a crash, it has the name of the
+			// segment that would follow it
+			mlog_free_segment(segment);
+			fprintf(stderr, "%s: removing segment %d\n",
+				directory, firstNum);
+			mlog_remove_files(log, firstNum);
+			broken = 1;
+		}
+		else if (!mlog_append_segment(log, segment)) {
+			mlog_free_segment(segment);
+			failed = 1;
+		}
+		else {
+			// Lines are added to the last segment only
+			if (log->nSegments > 1) {
+				mlog_seal(log->segments[log->nSegments - 2]);
+			}
+			else {
+				log->firstNum = firstNum;
+			}
+			log->nextNum = firstNum + segment->count;
+			log->bytes += segment->textLength;
+			broken = !whole;
+		}
+	}
+	for (i = 0; i < nEntries; i++) {
+		free(entries[i]);
+	}
+	free(entries);
+	if (failed) {
+		mlog_free(log);
+		return NULL;
+	}
+
+	if (log->nSegments > 0) {
+		MESSAGE_SEGMENT * last = log->segments[log->nSegments - 1];
+		if (ftruncate(last->dataFd, MLOG_SEGMENT_BYTES) < 0) {
+			perror("mlog_open");
+			mlog_seal(last);
+			// Fill up the last segment: the next message starts a new one
+			last->textCapacity = last->textLength;
+		}
+	}
+
+	// The limits may have changed since
+	mlog_trim(log);
+	return log;
+}
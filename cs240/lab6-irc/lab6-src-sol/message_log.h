@@ -0,0 +1,83 @@
+#if !defined MESSAGE_LOG_H
+#define MESSAGE_LOG_H
+
+//
+// Log of the messages sent to a room, numbered from 1. The messages are
+// stored in segments of up to MLOG_SEGMENT_MESSAGES, already formatted
+// as the "<number> <user> <message>\r\n" lines that GET-MESSAGES answers,
+// so that the messages after a given number are found by their position
+// and written to a socket straight from the log.
+//
+// The oldest messages are dropped once the log holds more than
+// maxMessages messages or maxBytes bytes of lines (0 for no limit).
+//
+// A log opened with mlog_open() is kept in a directory, with two
+// append-only files per segment, named by the number of its first
+// message:
+//
+//   <first>.log   the lines, mapped in memory with mmap()
+//   <first>.idx   the end offset of every line in .log, uint32 each
+//
+// A line is copied into the mapping before its offset is appended to the
+// index, so the index says which lines are complete. Opening the log
+// again maps the segments and reads their indexes, without reading or
+// replaying the messages. The files of the dropped segments are removed.
+//
+// Only the segment being filled stays mapped. A segment is synced to
+// disk and unmapped once it is full (sealed), and mapped again, read
+// only, when its lines are visited. At most MLOG_MAPPED_SEGMENTS sealed
+// segments stay mapped, the ones visited last, so that a process with
+// many logs keeps few mappings. The lines of the segment being filled
+// are only synced by mlog_sync(), which the caller runs in batches.
+//
+
+#define MLOG_SEGMENT_MESSAGES 1024
+// Space mapped for the lines of a segment. The file only takes the
+// space of the lines written, and a segment that fills it up is closed
+// before MLOG_SEGMENT_MESSAGES.
+#define MLOG_SEGMENT_BYTES (4 * 1024 * 1024)
+#define MLOG_MAPPED_SEGMENTS 2
+
+typedef struct MESSAGE_SEGMENT {
+	int firstNum;		// number of its first message
+	int count;		// messages in it
+	char * text;		// their lines, one after the other
+	int textLength;
+	int textCapacity;
+	int mapped;		// text is the mapping of its .log file, or
+				// NULL while a sealed segment is not mapped
+	int mapLength;		// bytes mapped
+	int lastVisit;		// visit of the log that last read it
+	int unsynced;		// lines added since the last sync
+	int dataFd;		// files of the segment being filled, or -1
+	int indexFd;
+	// start of each line in text
+	int offsets[ MLOG_SEGMENT_MESSAGES ];
+} MESSAGE_SEGMENT;
+
+typedef struct MESSAGE_LOG {
+	int firstNum;		// oldest message kept
+	int nextNum;		// number of the next message
+	long bytes;		// bytes of the lines kept
+	int maxMessages;
+	long maxBytes;
+	char * directory;	// of the segment files, or NULL
+	MESSAGE_SEGMENT ** segments;	// oldest first
+	int nSegments;
+	int maxSegments;
+	int nMapped;		// sealed segments mapped
+	int visits;		// calls to mlog_visit_after()
+} MESSAGE_LOG;
+
+typedef void (*MLOG_VISIT_FUNC)(const char * lines, int length, void * arg);
+
+MESSAGE_LOG * mlog_create(int maxMessages, long maxBytes);
+MESSAGE_LOG * mlog_open(const char * directory, int maxMessages, long maxBytes);
+void mlog_free(MESSAGE_LOG * log);
+int mlog_add(MESSAGE_LOG * log, const char * user, const char * message);
+int mlog_visit_after(MESSAGE_LOG * log, int messageNum, int lastNum,
+		     long maxBytes, MLOG_VISIT_FUNC func, void * arg);
+int mlog_number_messages(MESSAGE_LOG * log);
+void mlog_sync(MESSAGE_LOG * log);
+
+#endif
@@ -0,0 +1,551 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <crypt.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "password_journal.h"
+
+// Prefix of the crypt() method used for new passwords: SHA-512
+#define HASH_PREFIX "$6$"
+
+// Compact once the journal holds this many records
+#define COMPACT_RECORDS 4096
+
+//
+// The snapshot is a header followed by one record per user:
+//
+// "TALKPW1\0" <number of users, uint32>
+// <name length, uint32> <password length, uint32> name\0 password\0
+// ...
+//
+// Lengths include the terminating 0 and are in host byte order.
+//
+#define SNAPSHOT_MAGIC "TALKPW1"
+#define SNAPSHOT_MAGIC_LENGTH 8
+
+// Sync the directory that holds path, so that a rename or creation
+// in it survives a crash
+static void syncDirectory(const char * path) {
+	char dir[1024];
+	const char * slash = strrchr(path, '/');
+	if (slash == NULL) {
+		strcpy(dir, ".");
+	}
+	else {
+		snprintf(dir, sizeof(dir), "%.*s", (int) (slash - path + 1), path);
+	}
+
+	int fd = open(dir, O_RDONLY);
+	if (fd >= 0) {
+		fsync(fd);
+		close(fd);
+	}
+}
+
+// The snapshot and the journal overlap after a crash during compaction,
+// so a user may be loaded twice
+static void loadUser(HASH_TABLE * users, const char * name,
+		     const char * password) {
+	void * previous;
+	if (htable_find(users, name, &previous)) {
+		free(previous);
+	}
+	htable_insert(users, name, strdup(password));
+}
+
+static char * temporaryName(const char * fileName) {
+	char * name = (char *) malloc(strlen(fileName) + 5);
+	if (name != NULL) {
+		sprintf(name, "%s.tmp", fileName);
+	}
+	return name;
+}
+
+//
+// Loads the users of the snapshot. Returns 1 if it was loaded or did not
+// exist, and 0 if it is damaged.
+//
+static int loadSnapshot(const char * snapshotName, HASH_TABLE * users) {
+	int fd = open(snapshotName, O_RDONLY);
+	if (fd < 0) {
+		return errno == ENOENT;
+	}
+
+	// Read it in one go and parse it in memory
+	struct stat st;
+	char * buffer = NULL;
+	size_t size = 0;
+	if (fstat(fd, &st) == 0) {
+		size = st.st_size;
+		buffer = (char *) malloc(size + 1);
+	}
+	size_t nread = 0;
+	while (buffer != NULL && nread < size) {
+		ssize_t n = read(fd, buffer + nread, size - nread);
+		if (n <= 0) {
+			break;
+		}
+		nread += n;
+	}
+	close(fd);
+	if (buffer == NULL || nread < size ||
+	    size < SNAPSHOT_MAGIC_LENGTH + sizeof(uint32_t) ||
+	    memcmp(buffer, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LENGTH)) {
+		free(buffer);
+		return 0;
+	}
+
+	uint32_t count;
+	memcpy(&count, buffer + SNAPSHOT_MAGIC_LENGTH, sizeof(count));
+	char * p = buffer + SNAPSHOT_MAGIC_LENGTH + sizeof(count);
+	char * end = buffer + size;
+
+	uint32_t i;
+	for (i = 0; i < count; i++) {
+		uint32_t lengths[2];
+		if (end - p < (ssize_t) sizeof(lengths)) {
+			break;
+		}
+		memcpy(lengths, p, sizeof(lengths));
+		p += sizeof(lengths);
+
+		char * name = p;
+		char * password = name + lengths[0];
+		if (lengths[0] == 0 || lengths[1] == 0 ||
+		    lengths[0] > (size_t) (end - name) ||
+		    lengths[1] > (size_t) (end - password) ||
+		    name[lengths[0] - 1] != 0 ||
+		    password[lengths[1] - 1] != 0) {
+			break;
+		}
+		p = password + lengths[1];
+
+		loadUser(users, name, password);
+	}
+
+	free(buffer);
+	return i == count && p == end;
+}
+
+//
+// Replays the records of the journal. A record that ends with its blank
+// line but does not hold exactly a name and a password is skipped, and
+// kept. Only a record cut short by a crash, at the end of the journal,
+// is dropped, and the journal truncated to the last complete record.
+//
+static int replayJournal(PASSWORD_JOURNAL * journal, HASH_TABLE * users) {
+	int fd = dup(journal->fd);
+	FILE * file = fd < 0 ? NULL : fdopen(fd, "r");
+	if (file == NULL) {
+		if (fd >= 0) {
+			close(fd);
+		}
+		return 0;
+	}
+
+	char * line = NULL;
+	size_t lineSize = 0;
+	ssize_t lineLength;
+	char * fields[2] = { NULL, NULL };	// name and password
+	int lines = 0;		// lines of the record read so far
+	off_t offset = 0;	// end of the lines read so far
+
+	journal->length = 0;
+	journal->records = 0;
+	while ((lineLength = getline(&line, &lineSize, file)) > 0 &&
+	       line[lineLength - 1] == '\n') {
+		offset += lineLength;
+		if (lineLength > 1) {
+			if (lines < 2) {
+				fields[lines] = strndup(line, lineLength - 1);
+			}
+			lines++;
+			continue;
+		}
+
+		// A blank line ends the record
+		if (lines == 2 && fields[0] != NULL && fields[1] != NULL) {
+			loadUser(users, fields[0], fields[1]);
+			journal->records++;
+		}
+		else if (lines > 0) {
+			fprintf(stderr, "%s: skipping malformed record at offset %ld\n",
+				journal->fileName, (long) journal->length);
+		}
+		free(fields[0]);
+		free(fields[1]);
+		fields[0] = fields[1] = NULL;
+		lines = 0;
+		journal->length = offset;
+	}
+
+	free(fields[0]);
+	free(fields[1]);
+	free(line);
+	fclose(file);
+
+	struct stat st;
+	if (fstat(journal->fd, &st) == 0 && st.st_size > journal->length) {
+		fprintf(stderr, "%s: dropping incomplete record at offset %ld\n",
+			journal->fileName, (long) journal->length);
+		if (ftruncate(journal->fd, journal->length) < 0) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+//
+// Opens the journal and loads the users of the snapshot and journal.
+// It returns 1 on success, 0 otherwise.
+//
+int pwjournal_open(PASSWORD_JOURNAL * journal, const char * fileName,
+		   const char * snapshotName, HASH_TABLE * users) {
+	memset(journal, 0, sizeof(PASSWORD_JOURNAL));
+	journal->fileName = strdup(fileName);
+	journal->snapshotName = strdup(snapshotName);
+	journal->compactAt = COMPACT_RECORDS;
+	if (journal->fileName == NULL || journal->snapshotName == NULL) {
+		return 0;
+	}
+
+	journal->fd = open(fileName, O_RDWR | O_APPEND);
+	if (journal->fd < 0) {
+		if (errno != ENOENT) {
+			return 0;
+		}
+
+		// No journal: start with no users
+		unlink(snapshotName);
+		journal->fd = open(fileName, O_RDWR | O_APPEND | O_CREAT, 0600);
+		if (journal->fd < 0) {
+			return 0;
+		}
+		syncDirectory(fileName);
+		return 1;
+	}
+
+	if (!loadSnapshot(snapshotName, users)) {
+		fprintf(stderr, "%s: damaged snapshot\n", snapshotName);
+		return 0;
+	}
+	return replayJournal(journal, users);
+}
+
+//
+// Appends a new user to the journal. It is written at once, but only
+// synced to disk by the next pwjournal_sync(), so that a burst of new
+// users costs a single sync. Returns 1 on success, 0 otherwise.
+//
+int pwjournal_append(PASSWORD_JOURNAL * journal, const char * name,
+		     const char * password) {
+	size_t nameLength = strlen(name);
+	size_t passwordLength = strlen(password);
+	// Each is one line of the record
+	if (nameLength == 0 || passwordLength == 0 ||
+	    strchr(name, '\n') != NULL || strchr(password, '\n') != NULL) {
+		return 0;
+	}
+	size_t length = nameLength + passwordLength + 3;
+	char * record = (char *) malloc(length + 1);
+	if (record == NULL) {
+		return 0;
+	}
+	sprintf(record, "%s\n%s\n\n", name, password);
+
+	// O_APPEND: a single write adds the whole record
+	ssize_t n;
+	while ((n = write(journal->fd, record, length)) < 0 && errno == EINTR) {
+	}
+	free(record);
+	if (n != (ssize_t) length) {
+		// Do not leave a partial record behind
+		if (n > 0 && ftruncate(journal->fd, journal->length) < 0) {
+			perror("ftruncate");
+		}
+		return 0;
+	}
+
+	journal->length += length;
+	journal->records++;
+	journal->dirty = 1;
+	return 1;
+}
+
+//
+// Syncs the records appended since the last call.
+//
+void pwjournal_sync(PASSWORD_JOURNAL * journal) {
+	if (!journal->dirty) {
+		return;
+	}
+	if (fdatasync(journal->fd) < 0) {
+		perror("fdatasync");
+		return;
+	}
+	journal->dirty = 0;
+}
+
+typedef struct SNAPSHOT_IMAGE {
+	char * data;
+	size_t length;
+	size_t capacity;
+} SNAPSHOT_IMAGE;
+
+static void addSnapshotBytes(SNAPSHOT_IMAGE * image, const void * bytes,
+			     size_t length) {
+	if (image->data == NULL) {
+		return;
+	}
+	if (image->length + length > image->capacity) {
+		size_t capacity = 2 * (image->length + length);
+		char * data = (char *) realloc(image->data, capacity);
+		if (data == NULL) {
+			free(image->data);
+			image->data = NULL;
+			return;
+		}
+		image->data = data;
+		image->capacity = capacity;
+	}
+	memcpy(image->data + image->length, bytes, length);
+	image->length += length;
+}
+
+static void addSnapshotRecord(const char * name, void * password,
+			      void * arg) {
+	SNAPSHOT_IMAGE * image = (SNAPSHOT_IMAGE *) arg;
+	uint32_t lengths[2];
+	lengths[0] = strlen(name) + 1;
+	lengths[1] = strlen((char *) password) + 1;
+	addSnapshotBytes(image, lengths, sizeof(lengths));
+	addSnapshotBytes(image, name, lengths[0]);
+	addSnapshotBytes(image, password, lengths[1]);
+}
+
+// Copy every user into the bytes of a snapshot. Returns NULL if there is
+// not enough memory.
+static char * copySnapshot(HASH_TABLE * users, size_t * length) {
+	SNAPSHOT_IMAGE image;
+	image.capacity = 4096;
+	image.length = 0;
+	image.data = (char *) malloc(image.capacity);
+
+	uint32_t count = htable_number_elements(users);
+	addSnapshotBytes(&image, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LENGTH);
+	addSnapshotBytes(&image, &count, sizeof(count));
+	htable_visit(users, addSnapshotRecord, &image);
+
+	*length = image.length;
+	return image.data;
+}
+
+// Runs in the compaction thread: write the copy of the users to the
+// temporary snapshot. It touches nothing else of the journal.
+static void * writeSnapshot(void * arg) {
+	PASSWORD_JOURNAL * journal = (PASSWORD_JOURNAL *) arg;
+	char * fileName = temporaryName(journal->snapshotName);
+	int fd = fileName == NULL ? -1 :
+		open(fileName, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+
+	int ok = fd >= 0;
+	size_t written = 0;
+	while (ok && written < journal->compactImageLength) {
+		ssize_t n = write(fd, journal->compactImage + written,
+				  journal->compactImageLength - written);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		ok = n > 0;
+		written += ok ? n : 0;
+	}
+	ok = ok && fsync(fd) == 0;
+	if (fd >= 0 && close(fd) < 0) {
+		ok = 0;
+	}
+	free(fileName);
+
+	journal->compactOk = ok;
+	__atomic_store_n(&journal->compactDone, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+//
+// The snapshot of the thread is complete: install it, and rewrite the
+// journal with only the records added since the users were copied. If we
+// stop in between, the old journal is replayed on top of the new
+// snapshot, which gives the same users.
+//
+static void finishCompaction(PASSWORD_JOURNAL * journal) {
+	char * snapshotTemporary = temporaryName(journal->snapshotName);
+	char * journalTemporary = temporaryName(journal->fileName);
+	char * tail = NULL;
+	int fd = -1;
+
+	if (snapshotTemporary == NULL || journalTemporary == NULL ||
+	    rename(snapshotTemporary, journal->snapshotName) < 0) {
+		perror("compaction");
+		goto done;
+	}
+	syncDirectory(journal->snapshotName);
+
+	size_t tailLength = journal->length - journal->compactLength;
+	tail = (char *) malloc(tailLength + 1);
+	if (tail == NULL ||
+	    pread(journal->fd, tail, tailLength, journal->compactLength)
+	    != (ssize_t) tailLength) {
+		perror("compaction");
+		goto done;
+	}
+
+	fd = open(journalTemporary, O_RDWR | O_APPEND | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0 ||
+	    write(fd, tail, tailLength) != (ssize_t) tailLength ||
+	    fsync(fd) < 0 ||
+	    rename(journalTemporary, journal->fileName) < 0) {
+		perror("compaction");
+		if (fd >= 0) {
+			close(fd);
+			unlink(journalTemporary);
+		}
+		goto done;
+	}
+	syncDirectory(journal->fileName);
+
+	// Keep appending to the new journal
+	close(journal->fd);
+	journal->fd = fd;
+	journal->length = tailLength;
+	journal->records -= journal->compactRecords;
+	journal->dirty = 0;
+	journal->compactAt = journal->records + COMPACT_RECORDS;
+
+done:
+	free(tail);
+	free(snapshotTemporary);
+	free(journalTemporary);
+}
+
+//
+// Called from the event loop, with the users locked against changes. It
+// collects a finished compaction, and starts a new one once the journal
+// is long enough.
+//
+void pwjournal_maintain(PASSWORD_JOURNAL * journal, HASH_TABLE * users) {
+	if (journal->compacting) {
+		if (!__atomic_load_n(&journal->compactDone, __ATOMIC_ACQUIRE)) {
+			// Still writing
+			return;
+		}
+		pthread_join(journal->compactThread, NULL);
+		journal->compacting = 0;
+		free(journal->compactImage);
+		journal->compactImage = NULL;
+		if (journal->compactOk) {
+			finishCompaction(journal);
+		}
+		else {
+			// Wait for as many new records before trying again
+			fprintf(stderr, "%s: compaction failed\n", journal->fileName);
+			journal->compactAt = journal->records + COMPACT_RECORDS;
+			char * snapshotTemporary = temporaryName(journal->snapshotName);
+			if (snapshotTemporary != NULL) {
+				unlink(snapshotTemporary);
+				free(snapshotTemporary);
+			}
+		}
+	}
+
+	if (journal->records < journal->compactAt) {
+		return;
+	}
+
+	// The thread gets a copy of the users as they are now, that matches
+	// the journal up to compactLength
+	journal->compactImage = copySnapshot(users, &journal->compactImageLength);
+	if (journal->compactImage == NULL) {
+		perror("compaction");
+		journal->compactAt = journal->records + COMPACT_RECORDS;
+		return;
+	}
+	journal->compactDone = 0;
+	journal->compactOk = 0;
+	journal->compactLength = journal->length;
+	journal->compactRecords = journal->records;
+
+	int error = pthread_create(&journal->compactThread, NULL,
+				   writeSnapshot, journal);
+	if (error != 0) {
+		fprintf(stderr, "compaction: %s\n", strerror(error));
+		free(journal->compactImage);
+		journal->compactImage = NULL;
+		journal->compactAt = journal->records + COMPACT_RECORDS;
+		return;
+	}
+	journal->compacting = 1;
+}
+
+//
+// It returns the stored form of a password, hashed with a new random
+// salt, in memory from malloc(). It returns NULL on failure.
+//
+char * pwjournal_hash(const char * password) {
+	char salt[ CRYPT_GENSALT_OUTPUT_SIZE ];
+	if (crypt_gensalt_rn(HASH_PREFIX, 0, NULL, 0, salt, sizeof(salt)) == NULL) {
+		return NULL;
+	}
+
+	// struct crypt_data is too large for the stack of a worker
+	struct crypt_data * data =
+		(struct crypt_data *) calloc(1, sizeof(struct crypt_data));
+	if (data == NULL) {
+		return NULL;
+	}
+	char * hash = crypt_r(password, salt, data);
+	char * stored = NULL;
+	if (hash != NULL && hash[0] != '*') {
+		stored = strdup(hash);
+	}
+	free(data);
+	return stored;
+}
+
+//
+// Returns 1 if stored is in the hashed form, and 0 if it is a plain
+// password from an older file.
+//
+int pwjournal_is_hashed(const char * stored) {
+	return !strncmp(stored, HASH_PREFIX, strlen(HASH_PREFIX));
+}
+
+//
+// Returns 1 if password matches the stored form, and 0 otherwise.
+//
+int pwjournal_verify(const char * password, const char * stored) {
+	if (!pwjournal_is_hashed(stored)) {
+		return !strcmp(password, stored);
+	}
+
+	struct crypt_data * data =
+		(struct crypt_data *) calloc(1, sizeof(struct crypt_data));
+	if (data == NULL) {
+		return 0;
+	}
+	char * hash = crypt_r(password, stored, data);
+
+	// Compare every byte, so that the time taken does not tell how
+	// much of the hash matched
+	int differ = hash == NULL || strlen(hash) != strlen(stored);
+	if (!differ) {
+		size_t i;
+		for (i = 0; stored[i] != 0; i++) {
+			differ |= hash[i] ^ stored[i];
+		}
+	}
+	free(data);
+	return !differ;
+}
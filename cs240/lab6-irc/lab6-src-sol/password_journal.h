@@ -0,0 +1,52 @@
+#if !defined PASSWORD_JOURNAL_H
+#define PASSWORD_JOURNAL_H
+
+#include <sys/types.h>
+#include <pthread.h>
+#include "hash_table.h"
+
+//
+// Persistent store of the user passwords. New users are appended to a
+// text journal, in the format of llist_save(), and synced in batches.
+// When the journal grows long, the users are copied into a binary
+// snapshot, which a thread writes in the background, and the journal is
+// cut down to the records added after the snapshot. At startup the snapshot is loaded
+// and the journal is replayed on top of it.
+//
+// The journal is the primary file: without it the snapshot is discarded,
+// so removing the journal removes every user.
+//
+// Passwords are stored hashed with salted SHA-512 crypt(). Files written
+// before that hold plain passwords, which are still accepted and can be
+// replaced by their hash once the user logs in.
+//
+
+typedef struct PASSWORD_JOURNAL {
+	char * fileName;	// text journal
+	char * snapshotName;	// binary snapshot
+	int fd;			// journal, opened for appending
+	off_t length;		// bytes in the journal
+	int records;		// records in the journal
+	int dirty;		// records appended but not synced yet
+	int compacting;		// a thread is writing a snapshot
+	pthread_t compactThread;
+	char * compactImage;	// snapshot written by the thread
+	size_t compactImageLength;
+	int compactDone;	// set by the thread once it is finished
+	int compactOk;		// whether it wrote the snapshot
+	off_t compactLength;	// journal length when the copy was made
+	int compactRecords;	// journal records when the copy was made
+	int compactAt;		// records that start the next compaction
+} PASSWORD_JOURNAL;
+
+int pwjournal_open(PASSWORD_JOURNAL * journal, const char * fileName,
+		   const char * snapshotName, HASH_TABLE * users);
+int pwjournal_append(PASSWORD_JOURNAL * journal, const char * name,
+		     const char * password);
+void pwjournal_sync(PASSWORD_JOURNAL * journal);
+void pwjournal_maintain(PASSWORD_JOURNAL * journal, HASH_TABLE * users);
+char * pwjournal_hash(const char * password);
+int pwjournal_verify(const char * password, const char * stored);
+int pwjournal_is_hashed(const char * stored);
+
+#endif
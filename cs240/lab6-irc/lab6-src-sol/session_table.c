@@ -0,0 +1,124 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
+#include "session_table.h"
+
+//
+// It returns a new empty SESSION_TABLE whose sessions last lifetime
+// seconds, or NULL if it cannot be allocated.
+//
+SESSION_TABLE * sessions_create(int lifetime) {
+	SESSION_TABLE * sessions = (SESSION_TABLE *) malloc(sizeof(SESSION_TABLE));
+	if (sessions == NULL) {
+		return NULL;
+	}
+	sessions->tokens = htable_create();
+	if (sessions->tokens == NULL) {
+		free(sessions);
+		return NULL;
+	}
+	sessions->lifetime = lifetime;
+	return sessions;
+}
+
+// Fills token with SESSION_TOKEN_LENGTH hex digits of 128 random bits
+static int sessions_new_token(char * token) {
+	unsigned char bytes[ SESSION_TOKEN_LENGTH / 2 ];
+	size_t n = 0;
+	while (n < sizeof(bytes)) {
+		ssize_t got = getrandom(bytes + n, sizeof(bytes) - n, 0);
+		if (got < 0) {
+			return 0;
+		}
+		n += got;
+	}
+
+	int i;
+	for (i = 0; i < (int) sizeof(bytes); i++) {
+		sprintf(token + 2 * i, "%02x", bytes[i]);
+	}
+	return 1;
+}
+
+//
+// Opens a session for user, whose token is written to token (that has
+// room for SESSION_TOKEN_LENGTH + 1 chars). Returns 1 on success, 0
+// otherwise.
+//
+int sessions_login(SESSION_TABLE * sessions, const char * user,
+		   time_t now, char * token) {
+	SESSION * session = (SESSION *) malloc(sizeof(SESSION));
+	if (session == NULL) {
+		return 0;
+	}
+	session->user = strdup(user);
+	session->expires = now + sessions->lifetime;
+
+	// A token that is already taken is as likely as guessing one, but
+	// it must not replace the session of somebody else
+	if (session->user == NULL || !sessions_new_token(token) ||
+	    htable_find(sessions->tokens, token, NULL) ||
+	    htable_insert(sessions->tokens, token, session) < 0) {
+		free(session->user);
+		free(session);
+		return 0;
+	}
+	return 1;
+}
+
+//
+// Returns 1 if token names an open session of user, and 0 otherwise.
+//
+int sessions_check(SESSION_TABLE * sessions, const char * token,
+		   const char * user, time_t now) {
+	void * data;
+	if (!htable_find(sessions->tokens, token, &data)) {
+		return 0;
+	}
+	SESSION * session = (SESSION *) data;
+	return now < session->expires && !strcmp(session->user, user);
+}
+
+//
+// Closes the session of user named by token. Returns 1 if it was open,
+// and 0 otherwise.
+//
+int sessions_logout(SESSION_TABLE * sessions, const char * token,
+		    const char * user) {
+	void * data;
+	if (!htable_find(sessions->tokens, token, &data) ||
+	    strcmp(((SESSION *) data)->user, user)) {
+		return 0;
+	}
+	SESSION * session = (SESSION *) data;
+	htable_remove(sessions->tokens, token);
+	free(session->user);
+	free(session);
+	return 1;
+}
+
+//
+// Removes the sessions that expired by now. It returns how many.
+//
+int sessions_expire(SESSION_TABLE * sessions, time_t now) {
+	int removed = 0;
+	const char * token;
+	void * data;
+	while ((token = htable_first(sessions->tokens, &data)) != NULL &&
+	       ((SESSION *) data)->expires <= now) {
+		SESSION * session = (SESSION *) data;
+		htable_remove(sessions->tokens, token);
+		free(session->user);
+		free(session);
+		removed++;
+	}
+	return removed;
+}
+
+//
+// It returns the number of open sessions.
+//
+int sessions_number(SESSION_TABLE * sessions) {
+	return htable_number_elements(sessions->tokens);
+}
@@ -0,0 +1,39 @@
+#if !defined SESSION_TABLE_H
+#define SESSION_TABLE_H
+
+#include <time.h>
+#include "hash_table.h"
+
+//
+// Sessions opened by LOGIN. A session is named by a random token that
+// the client sends instead of its password, so that a command is
+// authenticated with one lookup instead of hashing the password again.
+//
+// Every session lasts the same number of seconds, so the insertion order
+// of the tokens is also their expiration order, and expired sessions
+// are removed from the oldest one on.
+//
+
+#define SESSION_TOKEN_LENGTH 32		// hex digits
+
+typedef struct SESSION {
+	char * user;
+	time_t expires;
+} SESSION;
+
+typedef struct SESSION_TABLE {
+	HASH_TABLE * tokens;	// token -> SESSION, oldest first
+	int lifetime;		// seconds
+} SESSION_TABLE;
+
+SESSION_TABLE * sessions_create(int lifetime);
+int sessions_login(SESSION_TABLE * sessions, const char * user,
+		   time_t now, char * token);
+int sessions_check(SESSION_TABLE * sessions, const char * token,
+		   const char * user, time_t now);
+int sessions_logout(SESSION_TABLE * sessions, const char * token,
+		    const char * user);
+int sessions_expire(SESSION_TABLE * sessions, time_t now);
+int sessions_number(SESSION_TABLE * sessions);
+
+#endif
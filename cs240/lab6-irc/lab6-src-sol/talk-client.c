@@ -10,6 +10,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <poll.h>
 
 char * user;
 char * password;
@@ -35,6 +36,11 @@ int port;
 int nmessages;
 char messages[MAX_MESSAGES][MAX_MESSAGE_LEN];
 
+// Connection where the server pushes the messages of the room
+int subscription = -1;
+char pending[MAX_MESSAGE_LEN];
+int npending;
+
 int open_client_socket(char * host, int port) {
 	// Initialize socket address structure
 	struct  sockaddr_in socketAddress;
@@ -97,12 +103,16 @@ int sendCommand(char * host, int port, char * command, char * user,
 	write(sock, args, strlen(args));
 	write(sock, "\r\n",2);
 
+	// Last command on this connection: the server closes it once answered
+	shutdown(sock, SHUT_WR);
+
 	// Keep reading until connection is closed or MAX_REPONSE
 	int n = 0;
 	int len = 0;
-	while ((n=read(sock, response+len, MAX_RESPONSE - len))>0) {
+	while ((n=read(sock, response+len, MAX_RESPONSE - 1 - len))>0) {
 		len += n;
 	}
+	response[len] = 0;
 
 	printf("response:%s\n", response);
 
@@ -146,12 +156,10 @@ static void update_display(void) {
 
 	//mvwprintw(screen,1,1,"            TALK %s:%d ", host, port);
 
-	getMessages();
-
-	// Print messages
+	// Print messages, the last one at the bottom
 	int i = 0;
-	for (i=0; i < 20; i++) {
-		mvwprintw(screen,23-i,1, messages[i] );		
+	for (i=0; i < 20 && i < nmessages; i++) {
+		mvwprintw(screen,21-i,1, "%s", messages[nmessages-1-i] );		
 	}
 
 	wrefresh(screen);
@@ -191,27 +199,67 @@ void add_user() {
 	}
 }
 
-void get_messages() {
-	// Try first to add user in case it does not exist.
+void login() {
+	// Send the session token instead of the password from now on
 	char response[ MAX_RESPONSE ];
-	sendCommand(host, port, "GET-MESSAGES", user, password, "0", response);
+	sendCommand(host, port, "LOGIN", user, password, "", response);
 
-	// Separate messages
-	char * p = response;
-	int i = 0;
-	int j = 0;
-	while (*p) {
-		if (*p == '\r') {
-			// Skip /n
-			p++;
+	if (!strncmp(response, "OK ", 3)) {
+		response[strcspn(response, "\r\n")] = 0;
+		password = strdup(response + 3);
+	}
+}
+
+void add_message(char * message) {
+	if (nmessages == MAX_MESSAGES) {
+		memmove(messages[0], messages[1], (MAX_MESSAGES-1)*MAX_MESSAGE_LEN);
+		nmessages--;
+	}
+	strncpy(messages[nmessages], message, MAX_MESSAGE_LEN - 1);
+	messages[nmessages][MAX_MESSAGE_LEN - 1] = 0;
+	nmessages++;
+}
+
+void subscribe_messages() {
+	// Enter the room and keep a connection open where the server
+	// sends every message as soon as it is posted
+	char commands[ 4 * MAX_MESSAGE_LEN ];
+	snprintf(commands, sizeof(commands),
+		 "ENTER-ROOM %s %s\r\nSUBSCRIBE %s %s 0\r\n",
+		 user, password, user, password);
+
+	subscription = open_client_socket(host, port);
+	write(subscription, commands, strlen(commands));
+}
+
+void read_messages() {
+	// Separate messages, one per line
+	char buffer[ MAX_RESPONSE ];
+	int n = read(subscription, buffer, sizeof(buffer));
+	if (n <= 0) {
+		add_message("*** Connection closed by the server");
+		close(subscription);
+		subscription = -1;
+		return;
+	}
+
+	int i;
+	for (i = 0; i < n; i++) {
+		if (buffer[i] == '\r') {
+			continue;
 		}
-		else {
-			messages[i][j] = *p;
-			p++;
+		if (buffer[i] != '\n' && npending < MAX_MESSAGE_LEN - 1) {
+			pending[npending++] = buffer[i];
+			continue;
+		}
+		if (buffer[i] == '\n') {
+			pending[npending] = 0;
+			// Skip the answers to ENTER-ROOM and SUBSCRIBE
+			if (npending > 0 && strcmp(pending, "OK")) {
+				add_message(pending);
+			}
+			npending = 0;
 		}
-	}
-	if (!strcmp(response,"OK\r\n")) {
-		printf("User %s added\n", user);
 	}
 }
 
@@ -230,16 +278,29 @@ int main(int argc, char **argv) {
 	sscanf(sport, "%d", &port);
 
 	add_user();
+	login();
+	subscribe_messages();
 	
 	screenInit();
+	update_display();
 	while (doloop) {
+		// Sleep until a key is pressed or a message arrives
+		struct pollfd fds[2];
+		fds[0].fd = 0;
+		fds[0].events = POLLIN;
+		fds[1].fd = subscription;
+		fds[1].events = POLLIN;
+		poll(fds, subscription >= 0 ? 2 : 1, -1);
+
+		if (subscription >= 0 && (fds[1].revents & (POLLIN | POLLHUP))) {
+			read_messages();
+		}
+
 		current_getch = getch();
 		if (current_getch == 113) {
 			doloop = 0;
 		}
-		//display_new_messages();
 		update_display();
-		usleep(100000);
 	}
 	screen_end();
 	printf("TEST ENDS\n");
@@ -7,10 +7,38 @@ const char * usage =
 "                                                               \n"
 "To use it in one window type:                                  \n"
 "                                                               \n"
-"   talk-server <port>                                       \n"
+"   talk-server [-t threads] [-m max-messages] [-b max-bytes]    \n"
+"               [-o max-output] [-w write-timeout]              \n"
+"               [-i idle-timeout] [-s message-dir]              \n"
+"               [-p hashers] [-a admin-user] [-d log-level]     \n"
+"               <port>                                          \n"
 "                                                               \n"
 "Where 1024 < port < 65536.             \n"
 "                                                               \n"
+"Each room keeps its last max-messages messages (default 100000)\n"
+"and at most max-bytes bytes of them (default 64MB). Use 0     \n"
+"for no limit.                                                  \n"
+"                                                               \n"
+"With -s, the messages of the rooms are saved in message-dir,  \n"
+"synced to disk at least once a second, and the rooms found    \n"
+"there are loaded at startup. Otherwise they are only kept in  \n"
+"memory.                                                        \n"
+"                                                               \n"
+"With -t, threads event loops (default 1) accept and serve the \n"
+"connections. With -p, hashers threads (default 2) hash the     \n"
+"passwords for them.                                            \n"
+"                                                               \n"
+"A connection is closed when more than max-output bytes wait  \n"
+"to be sent to it (default 4MB), when it reads               \n"
+"none of them for write-timeout seconds (default 30), or when \n"
+"it sends no command for idle-timeout seconds (default 300,   \n"
+"subscribers excepted). Use 0 for no limit.                    \n"
+"                                                               \n"
+"Only admin-user can run STATS, and nobody without -a.         \n"
+"                                                               \n"
+"With -d 1, the connections and commands are printed, with the \n"
+"passwords masked. Nothing is printed by default.              \n"
+"                                                               \n"
 "In another window type:                                       \n"
 "                                                               \n"
 "   telnet <host> <port>                                        \n"
@@ -29,37 +57,316 @@ const char * usage =
 #include <string.h>
 #include <stdio.h>
 #include <time.h>
-#include "linked_list.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <dirent.h>
+#include <ctype.h>
+#include "hash_table.h"
+#include "password_journal.h"
+#include "message_log.h"
+#include "session_table.h"
 
 #define PASSWORD_FILE "password.txt"
-LINKED_LIST * users;
-LINKED_LIST * usersInRoom;
+#define PASSWORD_SNAPSHOT "password.snapshot"
+PASSWORD_JOURNAL passwordJournal;
+pthread_mutex_t journalLock = PTHREAD_MUTEX_INITIALIZER;
+// User name -> hashed password
+HASH_TABLE * users;
+pthread_rwlock_t usersLock = PTHREAD_RWLOCK_INITIALIZER;
 
-typedef struct MESSAGE {
+// Tokens given by LOGIN, which commands accept instead of the password
+#define SESSION_LIFETIME (60 * 60)
+SESSION_TABLE * sessions;
+pthread_rwlock_t sessionsLock = PTHREAD_RWLOCK_INITIALIZER;
+time_t sessionsExpired;		// last time expired sessions were removed
+
+// A connection that SUBSCRIBEd to a room gets the new messages of the
+// room pushed to it
+typedef struct SUBSCRIPTION {
+	struct CONNECTION * conn;
+	struct ROOM * room;
 	char * user;
-	char * message;
-	int messageNum;
-} MESSAGE;
+	int lastNum;		// last message pushed
+	struct SUBSCRIPTION * next;	// subscriptions to the room
+	struct SUBSCRIPTION * previous;
+} SUBSCRIPTION;
+
+// Every room has its own users and messages. Room names start with #,
+// and commands without a room refer to the default room. Rooms are never
+// removed, so a ROOM pointer stays valid without holding roomsLock.
+typedef struct ROOM {
+	pthread_mutex_t lock;	// of everything below
+	char * name;
+	// User name -> NULL, for the users in the room
+	HASH_TABLE * users;
+	MESSAGE_LOG * messages;
+	SUBSCRIPTION * subscriptions;
+	int unsynced;		// in the list of rooms to sync
+	struct ROOM * nextUnsynced;
+} ROOM;
+
+#define DEFAULT_ROOM "#lobby"
+#define MAX_ROOM_NAME 64
+// Room name -> ROOM
+HASH_TABLE * rooms;
+pthread_rwlock_t roomsLock = PTHREAD_RWLOCK_INITIALIZER;
+ROOM * defaultRoom;
+
+// Messages kept by each room
+#define DEFAULT_MAX_MESSAGES 100000
+#define DEFAULT_MAX_MESSAGE_BYTES (64L * 1024 * 1024)
+int maxMessages = DEFAULT_MAX_MESSAGES;
+long maxMessageBytes = DEFAULT_MAX_MESSAGE_BYTES;
+// Each room keeps its log in a directory under it, or NULL
+char * messageDirectory = NULL;
+// Rooms with messages not synced to disk yet. They are synced in one
+// batch, at most once a second, like the users added in a round.
+ROOM * unsyncedRooms;
+pthread_mutex_t unsyncedLock = PTHREAD_MUTEX_INITIALIZER;
+time_t roomsSynced;		// last time the rooms were synced
+
+int QueueLength = SOMAXCONN;
+
+// Connections are kept open and can carry any number of commands. Input
+// is read in large chunks into a per-connection buffer, which may hold
+// several pipelined commands and the start of an incomplete one.
+//
+// Answers are added to a per-connection output buffer, that is sent
+// with one write after each chunk of commands, and later on when the
+// socket becomes writable again if it did not fit.
+#define MAX_COMMAND_LINE 1024
+#define INPUT_BUFFER_SIZE (16 * 1024)
+// Stop running commands while this much output waits for the client
+#define OUTPUT_HIGH_WATER (1024 * 1024)
+
+// A client that does not read its answers must not hold the memory of
+// the server or a connection forever: the connection is closed when
+// its output goes over maxOutput bytes, or none of it is sent in
+// writeTimeout seconds. A client that sends no command for idleTimeout
+// seconds is closed too, unless it is subscribed.
+//
+// Room logs are far larger than that, so the messages a subscriber
+// missed are added from the log a chunk at a time, as the client reads
+// them. GET-MESSAGES answers are not copied at all: their lines are
+// written from the log to the socket, up to HISTORY_CHUNK bytes with
+// each writev().
+#define DEFAULT_WRITE_TIMEOUT 30
+#define DEFAULT_IDLE_TIMEOUT 300
+#define DEFAULT_MAX_OUTPUT (4L * 1024 * 1024)
+#define HISTORY_CHUNK (256 * 1024)
+#define HISTORY_IOVECS 16
+long maxOutput = DEFAULT_MAX_OUTPUT;
+int writeTimeout = DEFAULT_WRITE_TIMEOUT;
+int idleTimeout = DEFAULT_IDLE_TIMEOUT;
+typedef struct CONNECTION {
+	int fd;
+	struct WORKER * worker;	// that serves it
+	char input[ INPUT_BUFFER_SIZE + 1 ];
+	int inputLength;
+	char * output;
+	int outputStart;	// first byte not sent yet
+	int outputLength;
+	int outputCapacity;
+	int inputClosed;	// the client closed its side
+	int closing;		// no more commands: close once output is sent
+	time_t lastInput;	// when the client last sent something
+	// Connections of the worker
+	struct CONNECTION * nextConn;
+	struct CONNECTION * previousConn;
+	// Any worker may push messages to the connection: the output and
+	// subscription are protected by lock
+	pthread_mutex_t lock;
+	time_t outputSince;	// output last sent, or became pending
+	int overflowed;		// output lost: close the connection
+	SUBSCRIPTION * subscription;	// or NULL
+	int dirty;		// in the dirty list of its worker
+	struct CONNECTION * nextDirty;
+	// Command waiting for a hasher, or NULL. No other command of the
+	// connection runs meanwhile.
+	struct HASH_JOB * job;
+	// Room whose messages are being sent as a GET-MESSAGES answer, or
+	// NULL. No other command of the connection runs meanwhile, and no
+	// message is pushed to it. Set with lock held.
+	ROOM * historyRoom;
+	int historyNum;		// last message sent, in part or in full
+	int historyLastNum;	// last message of the answer
+	// What was not sent of the line of historyNum, if a write stopped
+	// in the middle of it
+	char * historyTail;
+	int historyTailStart;
+	int historyTailLength;
+} CONNECTION;
+
+// Connections indexed by socket, so that commands can answer to an fd.
+// It has a slot for every possible fd, so it never moves. A closed fd
+// may be accepted again by another worker, so the slots are accessed
+// atomically.
+#define MAX_CONNECTIONS (1024 * 1024)
+CONNECTION ** connections;
+int maxConnections;
 
-// List of messages. They wrap around
-#define MAX_MESSAGES 100
-int messageNum=1;
-int lastMessage;
-MESSAGE messages[MAX_MESSAGES];
+// Counters of a worker, added up by STATS. Each worker only updates its
+// own, so a relaxed load and store is enough and no cache line is shared
+// with other workers.
+#define MAX_COMMANDS 32
+#define LATENCY_BUCKETS 32	// bucket i: under 2^i microseconds
+typedef struct STATS {
+	long accepted;		// connections
+	long closed;
+	long timedOut;		// closed by writeTimeout or idleTimeout
+	long overflowed;	// closed by maxOutput
+	long bytesIn;
+	long bytesOut;
+	// By position in the command table, the last one for unknown
+	// commands
+	long commands[ MAX_COMMANDS ];
+	long latency[ MAX_COMMANDS ][ LATENCY_BUCKETS ];
+} STATS;
 
-int QueueLength = 5;
+#define COUNT(counter, n) __atomic_store_n(&(counter), \
+	__atomic_load_n(&(counter), __ATOMIC_RELAXED) + (n), __ATOMIC_RELAXED)
+
+// Every worker thread runs its own event loop, with its own listening
+// socket. With several workers, SO_REUSEPORT has the kernel spread the
+// new connections among them.
+typedef struct WORKER {
+	pthread_t thread;
+	int masterSocket;
+	int epollFd;
+	int eventFd;		// woken up when other workers push messages
+	pthread_mutex_t dirtyLock;	// of dirty and hashed
+	// Subscribers with pushed messages to send at the end of the round
+	CONNECTION * dirty;
+	struct HASH_JOB * hashed;	// jobs back from the hashers
+	CONNECTION * conns;	// that it serves
+	time_t lastReap;	// last time timed out connections were closed
+	STATS stats;
+} WORKER;
+
+int nWorkers = 1;
+WORKER * workers;
+__thread WORKER * currentWorker;
+time_t startTime;
+
+// Hashing a password takes milliseconds, which an event loop cannot
+// spend without stalling all its connections. A command that needs a
+// hash is queued for the hasher threads, which hand it back to the
+// worker of its connection to be run.
+#define DEFAULT_HASHERS 2
+typedef struct HASH_JOB {
+	WORKER * worker;
+	CONNECTION * conn;	// or NULL once it is closed
+	struct timespec start;	// when the command was read
+	int command;		// in commandTable
+	char * user;		// copies, after the job
+	char * password;
+	char * args;
+	int ok;			// the password is the one of the user
+	char * hash;		// of the password, or NULL
+	struct HASH_JOB * next;
+} HASH_JOB;
+
+int nHashers = DEFAULT_HASHERS;
+HASH_JOB * hashQueue;		// oldest first
+HASH_JOB * hashQueueTail;
+pthread_mutex_t hashLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t hashReady = PTHREAD_COND_INITIALIZER;
+__thread HASH_JOB * currentJob;	// whose command is running
+
+// What is printed to stdout, set with -d. Passwords and tokens are
+// never printed.
+#define LOG_COMMANDS 1		// connections and commands
+int logLevel = 0;
+
+// The user that can run STATS, set with -a, or NULL for nobody
+char * adminUser = NULL;
+
+// Stop pushing messages to a subscriber while this much output is
+// pending. It catches up from the room log once it has read it.
+#define SUBSCRIBER_HIGH_WATER (256 * 1024)
+
+#define MAX_EVENTS 256
 
 // Processes time request
 void initialize();
-void processRequest( int socket );
+int processRequest( CONNECTION * conn, char * commandLine );
+void runCommand(int fd, int command, char * user, char * password,
+		char * args, struct timespec * start);
+int needsHash(int kind, char * user, char * password);
+int hashLater(CONNECTION * conn, int command, char * user, char * password,
+	      char * args, struct timespec * start);
+void * runHasher(void * arg);
 void addUser(int fd, char * user, char * password, char * args);
+void login(int fd, char * user, char * password, char * args);
+void logout(int fd, char * user, char * password, char * args);
 void enterRoom(int fd, char * user, char * password, char * args);
 void leaveRoom(int fd, char * user, char * password, char * args);
 void sendMessage(int fd, char * user, char * password, char * args);
 void getMessages(int fd, char * user, char * password, char * args);
 void getUsersInRoom(int fd, char * user, char * password, char * args);
 void getAllUsers(int fd, char * user, char * password, char * args);
-void addMessage(char * user, char * message);
+void createRoom(int fd, char * user, char * password, char * args);
+void listRooms(int fd, char * user, char * password, char * args);
+void subscribe(int fd, char * user, char * password, char * args);
+void unsubscribe(int fd, char * user, char * password, char * args);
+void addMessage(ROOM * room, char * user, char * message);
+int pushMessages(SUBSCRIPTION * subscription);
+void removeSubscription(SUBSCRIPTION * subscription);
+void unsubscribeConnection(CONNECTION * conn);
+int catchUp(CONNECTION * conn);
+int sendHistory(CONNECTION * conn);
+void stats(int fd, char * user, char * password, char * args);
+
+typedef void (*COMMAND_FUNC)(int fd, char * user, char * password, char * args);
+
+// What a command does with its password
+#define PASSWORD_TOKEN 0	// nothing, or takes it as a token
+#define PASSWORD_CHECK 1	// checks it, unless it is a token
+#define PASSWORD_LOGIN 2	// checks it, and hashes an old one
+#define PASSWORD_NEW 3		// hashes it
+
+typedef struct COMMAND {
+	const char * name;
+	COMMAND_FUNC func;
+	int password;
+} COMMAND;
+
+COMMAND commandTable[] = {
+	{ "ADD-USER", addUser, PASSWORD_NEW },
+	{ "LOGIN", login, PASSWORD_LOGIN },
+	{ "LOGOUT", logout, PASSWORD_TOKEN },
+	{ "ENTER-ROOM", enterRoom, PASSWORD_CHECK },
+	{ "LEAVE-ROOM", leaveRoom, PASSWORD_CHECK },
+	{ "SEND-MESSAGE", sendMessage, PASSWORD_CHECK },
+	{ "GET-MESSAGES", getMessages, PASSWORD_CHECK },
+	{ "GET-USERS-IN-ROOM", getUsersInRoom, PASSWORD_CHECK },
+	{ "GET-ALL-USERS", getAllUsers, PASSWORD_CHECK },
+	{ "CREATE-ROOM", createRoom, PASSWORD_CHECK },
+	{ "LIST-ROOMS", listRooms, PASSWORD_CHECK },
+	{ "SUBSCRIBE", subscribe, PASSWORD_CHECK },
+	{ "UNSUBSCRIBE", unsubscribe, PASSWORD_CHECK },
+	{ "STATS", stats, PASSWORD_CHECK },
+};
+#define N_COMMANDS ((int) (sizeof(commandTable) / sizeof(COMMAND)))
+
+void logPrintf(int level, const char * format, ...) {
+	if (logLevel < level) {
+		return;
+	}
+	va_list ap;
+	va_start(ap, format);
+	vprintf(format, ap);
+	va_end(ap);
+}
 
 int open_server_socket(int port) {
 
@@ -82,6 +389,14 @@ int open_server_socket(int port) {
 	int optval = 1; 
 	int err = setsockopt(masterSocket, SOL_SOCKET, SO_REUSEADDR, 
 			     (char *) &optval, sizeof( int ) );
+
+	// Every worker listens on the same port
+	if (nWorkers > 1 &&
+	    setsockopt(masterSocket, SOL_SOCKET, SO_REUSEPORT,
+		       (char *) &optval, sizeof( int ) ) < 0) {
+		perror("SO_REUSEPORT");
+		exit( -1 );
+	}
 	
 	// Bind the socket to the IP address and port
 	int error = bind( masterSocket,
@@ -103,398 +418,1873 @@ int open_server_socket(int port) {
 	return masterSocket;
 }
 
-int
-main( int argc, char ** argv )
-{
-	// Print usage if not enough arguments
-	if ( argc < 2 ) {
-		fprintf( stderr, "%s", usage );
-		exit( -1 );
-	}
-	
-	// Get the port from the arguments
-	int port = atoi( argv[1] );
-	
-	int masterSocket = open_server_socket(port);
-
-	initialize();
-	
-	while ( 1 ) {
-		
-		// Accept incoming connections
-		struct sockaddr_in clientIPAddress;
-		int alen = sizeof( clientIPAddress );
-		int slaveSocket = accept( masterSocket,
-					  (struct sockaddr *)&clientIPAddress,
-					  (socklen_t*)&alen);
-		
-		if ( slaveSocket < 0 ) {
-			perror( "accept" );
-			exit( -1 );
-		}
-		
-		// Process request.
-		processRequest( slaveSocket );		
+int setNonBlocking(int fd) {
+	int flags = fcntl(fd, F_GETFL, 0);
+	if (flags < 0) {
+		return -1;
 	}
+	return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
 }
 
-//
-// Commands:
-//   Commands are started y the client.
-//
-//   Request: ADD-USER <USER> <PASSWD>\r\n
-//   Answer: OK\r\n or DENIED\r\n
-//
-//    REQUEST: GET-ALL-USERS <USER> <PASSWD>\r\n
-//    Answer: USER1\r\n
-//            USER2\r\n
-//            ...
-//            \r\n
-//
-//   Request: ENTER-ROOM <USER> <PASSWD>\r\n
-//   Answer: OK\n or DENIED\r\n
-//
-//   Request: LEAVE-ROOM <USER> <PASSWD>\r\n
-//   Answer: OK\n or DENIED\r\n
-//
-//   Request: SEND-MESSAGE <USER> <PASSWD> <MESSAGE>\n
-//   Answer: OK\n or DENIED\n
-//
-//   Request: GET-MESSAGES <USER> <PASSWD> <LAST-MESSAGE-NUM>\r\n
-//   Answer: MSGNUM1 USER1 MESSAGE1\r\n
-//           MSGNUM2 USER2 MESSAGE2\r\n
-//           MSGNUM3 USER2 MESSAGE2\r\n
-//           ...\r\n
-//           \r\n
-//
-//    REQUEST: GET-USERS-IN-ROOM <USER> <PASSWD>\r\n
-//    Answer: USER1\r\n
-//            USER2\r\n
-//            ...
-//            \r\n
-//
-
-void
-processRequest( int fd )
-{
-	// Buffer used to store the comand received from the client
-	const int MaxCommandLine = 1024;
-	char commandLine[ MaxCommandLine + 1 ];
-	int commandLineLength = 0;
-	int n;
-	
-	// Currently character read
-	unsigned char prevChar = 0;
-	unsigned char newChar = 0;
-	
-	//
-	// The client should send COMMAND-LINE\n
-	// Read the name of the client character by character until a
-	// \n is found.
-	//
-
-	// Read character by character until a \n is found or the command string is full.
-	while ( commandLineLength < MaxCommandLine &&
-		read( fd, &newChar, 1) > 0 ) {
+// Output not sent yet. The caller holds conn->lock.
+int pendingBytes(CONNECTION * conn) {
+	return conn->outputLength - conn->outputStart;
+}
 
-		if (newChar == '\n' && prevChar == '\r') {
-			break;
-		}
-		
-		commandLine[ commandLineLength ] = newChar;
-		commandLineLength++;
+int pendingOutput(CONNECTION * conn) {
+	pthread_mutex_lock(&conn->lock);
+	int pending = pendingBytes(conn);
+	pthread_mutex_unlock(&conn->lock);
+	return pending;
+}
 
-		prevChar = newChar;
+// Other workers push messages to the connection, so the output buffer
+// is only touched with conn->lock held, here by the caller
+int appendOutputLocked(CONNECTION * conn, const void * buffer, size_t length) {
+	if (conn->overflowed ||
+	    (maxOutput > 0 && pendingBytes(conn) + length > maxOutput)) {
+		// An answer is missing, so the rest would make no sense
+		conn->overflowed = 1;
+		return -1;
 	}
-	
-	// Add null character at the end of the string
-	// Eliminate last \r
-	commandLineLength--;
-        commandLine[ commandLineLength ] = 0;
-
-	// Get command
-	char * command = commandLine;
-	char * space = strchr(command, ' ');
-	if (space==NULL) {
-		// No space. Send denied
-		const char * msg =  "ERROR (no command)\r\n";
-		write(fd, msg, strlen(msg));
-		close(fd);
-		return;
+	if (pendingBytes(conn) == 0) {
+		// The write timeout starts now
+		conn->outputSince = time(NULL);
 	}
 
-	// Skip space
-	*space = 0;
-	space++;
-
-	printf( "command=%s\n", command );
+	if (conn->outputStart > 0 &&
+	    conn->outputLength + length > conn->outputCapacity) {
+		// Reuse the space of what was already sent
+		memmove(conn->output, conn->output + conn->outputStart,
+			pendingBytes(conn));
+		conn->outputLength -= conn->outputStart;
+		conn->outputStart = 0;
+	}
 
-	// Find user
-	char * user = space;
-	space = strchr(space, ' ');
-	if (space==NULL) {
-		// No space. Send denied
-		const char * msg =  "ERROR (no user)\r\n";
-		write(fd, msg, strlen(msg));
-		close(fd);
-		return;
+	if (conn->outputLength + length > conn->outputCapacity) {
+		int capacity = conn->outputCapacity == 0 ? 4096 :
+			2 * conn->outputCapacity;
+		while (capacity < conn->outputLength + length) {
+			capacity *= 2;
+		}
+		char * output = (char *) realloc(conn->output, capacity);
+		if (output == NULL) {
+			perror("reply");
+			conn->overflowed = 1;
+			return -1;
+		}
+		conn->output = output;
+		conn->outputCapacity = capacity;
 	}
-	
-	// Skip space
-	*space = 0;
-	space++;
 
-	printf( "user=%s\n", user );
+	memcpy(conn->output + conn->outputLength, buffer, length);
+	conn->outputLength += length;
+	return 0;
+}
 
-	// Find password
-	char * password = space;
-	space = strchr(password, ' ');
+int appendOutput(CONNECTION * conn, const void * buffer, size_t length) {
+	pthread_mutex_lock(&conn->lock);
+	int result = appendOutputLocked(conn, buffer, length);
+	pthread_mutex_unlock(&conn->lock);
+	return result;
+}
 
-	if (space != NULL) {
-		*space = 0;
-		space++;
+// Add an answer to the output of the connection of socket fd
+int reply(int fd, const void * buffer, size_t length) {
+	CONNECTION * conn = NULL;
+	if (fd < maxConnections) {
+		conn = __atomic_load_n(&connections[fd], __ATOMIC_ACQUIRE);
 	}
-	else {
-		// Skip to end of string
-		space = password + strlen(password);
+	if (conn == NULL) {
+		return -1;
 	}
-	
-	printf( "password=%s\n", password );
+	return appendOutput(conn, buffer, length);
+}
 
-	char * args = space;
-	printf( "args=%s\n", args );
+// Send as much of the output as the socket takes. Returns -1 if the
+// connection is broken or lost some output.
+int flushOutput(CONNECTION * conn) {
+	pthread_mutex_lock(&conn->lock);
+	if (conn->overflowed) {
+		pthread_mutex_unlock(&conn->lock);
+		COUNT(currentWorker->stats.overflowed, 1);
+		logPrintf(LOG_COMMANDS, "connection %d output over %ld bytes\n",
+			  conn->fd, maxOutput);
+		return -1;
+	}
+
+	int result = 0;
+	while (pendingBytes(conn) > 0) {
+		ssize_t n = write(conn->fd, conn->output + conn->outputStart,
+				  pendingBytes(conn));
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				result = -1;
+			}
+			// else the event loop resumes once it is writable
+			break;
+		}
+		conn->outputStart += n;
+		conn->outputSince = time(NULL);
+		COUNT(currentWorker->stats.bytesOut, n);
+	}
 
-	if (!strcmp(command, "ADD-USER")) {
-		addUser(fd, user, password, args);
+	if (pendingBytes(conn) == 0) {
+		conn->outputStart = 0;
+		conn->outputLength = 0;
+		if (conn->outputCapacity > OUTPUT_HIGH_WATER) {
+			// Do not keep the memory of a large answer
+			free(conn->output);
+			conn->output = NULL;
+			conn->outputCapacity = 0;
+		}
 	}
-	else if (!strcmp(command, "ENTER-ROOM")) {
-		enterRoom(fd, user, password, args);
+	pthread_mutex_unlock(&conn->lock);
+	return result;
+}
+
+// Send the output, and catch up with the room of a subscriber for as
+// long as the socket takes it. Returns -1 if the connection is broken
+// or lost some output.
+int sendOutput(CONNECTION * conn) {
+	while ( 1 ) {
+		if (flushOutput(conn) < 0) {
+			return -1;
+		}
+		if (pendingOutput(conn) > 0 || !catchUp(conn)) {
+			return 0;
+		}
 	}
-	else if (!strcmp(command, "LEAVE-ROOM")) {
-		leaveRoom(fd, user, password, args);
+}
+
+// Have the worker of the connection send its output at the end of its
+// round. The caller holds the lock of the room the connection is
+// subscribed to, which keeps the connection open.
+void markDirty(CONNECTION * conn) {
+	WORKER * worker = conn->worker;
+	pthread_mutex_lock(&worker->dirtyLock);
+	int wake = 0;
+	if (!conn->dirty) {
+		conn->dirty = 1;
+		wake = worker->dirty == NULL && worker != currentWorker;
+		conn->nextDirty = worker->dirty;
+		worker->dirty = conn;
 	}
-	else if (!strcmp(command, "SEND-MESSAGE")) {
-		sendMessage(fd, user, password, args);
+	pthread_mutex_unlock(&worker->dirtyLock);
+
+	if (wake) {
+		uint64_t one = 1;
+		if (write(worker->eventFd, &one, sizeof(one)) < 0) {
+			perror("eventfd");
+		}
 	}
-	else if (!strcmp(command, "GET-MESSAGES")) {
-		getMessages(fd, user, password, args);
+}
+
+void closeConnection(CONNECTION * conn) {
+	// Nobody pushes to the connection once it has no subscription
+	unsubscribeConnection(conn);
+	if (conn->job != NULL) {
+		// The job is freed once it is back from the hasher
+		conn->job->conn = NULL;
 	}
-	else if (!strcmp(command, "GET-USERS-IN-ROOM")) {
-		getUsersInRoom(fd, user, password, args);
+
+	WORKER * worker = conn->worker;
+	pthread_mutex_lock(&worker->dirtyLock);
+	if (conn->dirty) {
+		CONNECTION ** link = &worker->dirty;
+		while (*link != conn) {
+			link = &(*link)->nextDirty;
+		}
+		*link = conn->nextDirty;
 	}
-	else if (!strcmp(command, "GET-ALL-USERS")) {
-		getAllUsers(fd, user, password, args);
+	pthread_mutex_unlock(&worker->dirtyLock);
+
+	if (conn->previousConn != NULL) {
+		conn->previousConn->nextConn = conn->nextConn;
 	}
 	else {
-		const char * msg =  "UNKNOWN COMMAND\n";
-		write(fd, msg, strlen(msg));
+		worker->conns = conn->nextConn;
+	}
+	if (conn->nextConn != NULL) {
+		conn->nextConn->previousConn = conn->previousConn;
 	}
 
-	// Send OK answer
-	//const char * msg =  "OK\n";
-	//write(fd, msg, strlen(msg));
+	epoll_ctl(worker->epollFd, EPOLL_CTL_DEL, conn->fd, NULL);
+	__atomic_store_n(&connections[conn->fd], NULL, __ATOMIC_RELEASE);
+	COUNT(worker->stats.closed, 1);
+	logPrintf(LOG_COMMANDS, "connection %d closed\n", conn->fd);
+	close(conn->fd);
+	pthread_mutex_destroy(&conn->lock);
+	free(conn->output);
+	free(conn->historyTail);
+	free(conn);
+}
+
+void acceptConnections(WORKER * worker) {
+	// Edge triggered: accept until there is no pending connection left
+	while ( 1 ) {
+		struct sockaddr_in clientIPAddress;
+		socklen_t alen = sizeof( clientIPAddress );
+		int slaveSocket = accept( worker->masterSocket,
+					  (struct sockaddr *)&clientIPAddress,
+					  &alen);
+		if ( slaveSocket < 0 ) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK &&
+			    errno != EINTR && errno != ECONNABORTED) {
+				perror( "accept" );
+			}
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			return;
+		}
 
+		// The table of connections only covers the descriptors
+		// allowed when the server started
+		if (slaveSocket >= maxConnections) {
+			fprintf(stderr, "connection %d refused: descriptors are "
+				"limited to %d\n", slaveSocket, maxConnections);
+			close(slaveSocket);
+			continue;
+		}
 
-	close(fd);
-	
-#if 0
-	// Get time of day
-	time_t now;
-	time(&now);
-	char	*timeString = ctime(&now);
-	
-	// Send name and greetings
-	const char * hi = "\nHi ";
-	const char * timeIs = " the time is:\n";
-	write( fd, hi, strlen( hi ) );
-	write( fd, name, strlen( name ) );
-	write( fd, timeIs, strlen( timeIs ) );
-	
-	// Send the time of day 
-	write(fd, timeString, strlen(timeString));
-	
-	// Send last newline
-	const char * newline="\n";
-	write(fd, newline, strlen(newline));
-#endif
-	
-}
+		CONNECTION * conn = (CONNECTION *) calloc(1, sizeof(CONNECTION));
+		if (conn == NULL || setNonBlocking(slaveSocket) < 0) {
+			perror("connection");
+			free(conn);
+			close(slaveSocket);
+			continue;
+		}
+		conn->fd = slaveSocket;
+		conn->worker = worker;
+		pthread_mutex_init(&conn->lock, NULL);
+		__atomic_store_n(&connections[slaveSocket], conn, __ATOMIC_RELEASE);
 
-void initialize()
-{
-	// Open password file
-	users = llist_create();
-	int result = llist_read(users, PASSWORD_FILE);
-	if ( result == 0 ) {
-		// No password file. Create it.
-		result = llist_save(users, PASSWORD_FILE);
-		if (result==0) {
-			printf("Cannot open %s\n", PASSWORD_FILE);
-			exit(1);
+		// Edge triggered EPOLLOUT only reports a full socket that
+		// becomes writable, which is when output is pending
+		struct epoll_event event;
+		event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		event.data.ptr = conn;
+		if (epoll_ctl(worker->epollFd, EPOLL_CTL_ADD, slaveSocket, &event) < 0) {
+			perror("epoll_ctl");
+			__atomic_store_n(&connections[slaveSocket], NULL, __ATOMIC_RELEASE);
+			close(slaveSocket);
+			pthread_mutex_destroy(&conn->lock);
+			free(conn);
+			continue;
 		}
-	}
+		COUNT(worker->stats.accepted, 1);
+		logPrintf(LOG_COMMANDS, "connection %d opened\n", slaveSocket);
 
-	// Initialize users in room
-	usersInRoom = llist_create();
-	if ( usersInRoom == NULL ) {
-		if (result==0) {
-			printf("Cannot create users in room\n");
-			exit(1);
+		conn->lastInput = time(NULL);
+		conn->previousConn = NULL;
+		conn->nextConn = worker->conns;
+		if (worker->conns != NULL) {
+			worker->conns->previousConn = conn;
 		}
+		worker->conns = conn;
 	}
+}
 
-	// Message list is a global variable so we do not need to initialize it
+// Process the complete commands at the start of the input buffer, and
+// move what is left of it to the front. It stops early when too much
+// output is pending, or a command waits for a hasher. Returns 0 if the
+// connection has to be closed, 1 once every complete command has run,
+// and 2 if it stopped early.
+int processCommands(CONNECTION * conn) {
+	char * start = conn->input;
+	char * end = conn->input + conn->inputLength;
+	char * searchFrom = start;
+	int stopped = 0;
 
-}
+	char * newline;
+	while ( (newline = (char *) memchr(searchFrom, '\n', end - searchFrom)) != NULL ) {
+		if (pendingOutput(conn) > OUTPUT_HIGH_WATER) {
+			stopped = 1;
+			break;
+		}
+		if (newline == start || newline[-1] != '\r') {
+			// A lone \n is part of the command
+			searchFrom = newline + 1;
+			continue;
+		}
 
-int checkPassword(int fd, char * user, char * password) {
-	// Check password
-	char * user_password = llist_lookup(users, user);
-	if (user_password == NULL || strcmp(user_password, password)) {
-		const char * msg =  "ERROR (Wrong password)\r\n";
-		write(fd, msg, strlen(msg));
-		close(fd);
-		return 0;		
+		// Eliminate \r\n
+		newline[-1] = 0;
+		int done = processRequest(conn, start);
+		start = newline + 1;
+		searchFrom = start;
+		if (!done) {
+			stopped = 1;
+			break;
+		}
 	}
 
-	return 1;
-	
-}
-
-void addUser(int fd, char * user, char * password, char * args)
-{
-	if (llist_lookup(users, user)!=NULL) {
-		const char * msg =  "ERROR (User Exists)\r\n";
-		write(fd, msg, strlen(msg));
-		close(fd);
-		return;		
+	conn->inputLength = end - start;
+	if (!stopped && conn->inputLength > MAX_COMMAND_LINE) {
+		const char * msg =  "ERROR (command too long)\r\n";
+		appendOutput(conn, msg, strlen(msg));
+		return 0;
 	}
+	memmove(conn->input, start, conn->inputLength);
+	return stopped ? 2 : 1;
+}
 
-	llist_add(users, user, password);
-	llist_save(users, PASSWORD_FILE);
+// Read everything available on a connection, process each complete
+// command, and send the answers. Returns 0 once the connection has to
+// be closed.
+int serviceConnection(CONNECTION * conn) {
+	// Catch up with what was not pushed while the client was slow
+	catchUp(conn);
 
-	const char * msg =  "OK\r\n";
-	write(fd, msg, strlen(msg));
-	close(fd);
+	while ( !conn->closing ) {
+		if (conn->job != NULL) {
+			// Go on once its command has run
+			return sendOutput(conn) >= 0;
+		}
+		if (conn->historyRoom != NULL) {
+			if (sendHistory(conn) < 0) {
+				return 0;
+			}
+			if (conn->historyRoom != NULL) {
+				// Go on once the client has read some of it
+				return 1;
+			}
+		}
 
-	return;		
-}
+		int status = processCommands(conn);
+		if (status == 0) {
+			conn->closing = 1;
+			break;
+		}
+		if (sendOutput(conn) < 0) {
+			return 0;
+		}
+		if (pendingOutput(conn) > OUTPUT_HIGH_WATER) {
+			// Go on once the client has read some of it
+			return 1;
+		}
+		if (status == 2) {
+			// Run the commands left
+			continue;
+		}
+		if (conn->inputClosed) {
+			// All the commands of the client have been run
+			conn->closing = 1;
+			break;
+		}
 
-void enterRoom(int fd, char * user, char * password, char * args)
-{
-	if (!checkPassword(fd, user, password)) {
-		return;
+		int n = read( conn->fd, conn->input + conn->inputLength,
+			      INPUT_BUFFER_SIZE - conn->inputLength);
+		if (n > 0) {
+			conn->inputLength += n;
+			conn->lastInput = time(NULL);
+			COUNT(currentWorker->stats.bytesIn, n);
+		}
+		else if (n == 0) {
+			// Client closed its side
+			conn->inputClosed = 1;
+		}
+		else if (errno != EINTR) {
+			return errno == EAGAIN || errno == EWOULDBLOCK;
+		}
 	}
-	
-	llist_add(usersInRoom, user, "");
 
-	addMessage(user, " entered the room.");
+	// Send the last answers before closing
+	if (sendOutput(conn) < 0) {
+		return 0;
+	}
+	return pendingOutput(conn) > 0;
+}
 
-	const char * msg =  "OK\r\n";
-	write(fd, msg, strlen(msg));
-	close(fd);
+// Sync the users added in this round, and collect or start a
+// compaction of the password journal
+void maintainPasswords() {
+	pthread_mutex_lock(&journalLock);
+	pwjournal_sync(&passwordJournal);
+	int maintain = passwordJournal.compacting ||
+		passwordJournal.records >= passwordJournal.compactAt;
+	pthread_mutex_unlock(&journalLock);
 
+	if (maintain) {
+		// The compaction copies the users: they must not be changing
+		pthread_rwlock_rdlock(&usersLock);
+		pthread_mutex_lock(&journalLock);
+		pwjournal_maintain(&passwordJournal, users);
+		pthread_mutex_unlock(&journalLock);
+		pthread_rwlock_unlock(&usersLock);
+	}
 }
 
-void leaveRoom(int fd, char * user, char * password, char * args)
-{
-	if (!checkPassword(fd, user, password)) {
+// Sync the messages added to the rooms, at most once a second
+void syncRooms() {
+	time_t now = time(NULL);
+	if (__atomic_load_n(&roomsSynced, __ATOMIC_RELAXED) == now) {
 		return;
 	}
-	
-	if (llist_lookup(usersInRoom, user)==NULL) {
-		const char * msg =  "DENIED (not in room)\r\n";
-		write(fd, msg, strlen(msg));
-		close(fd);
-	}
-	
-	llist_remove(usersInRoom, user);
+	__atomic_store_n(&roomsSynced, now, __ATOMIC_RELAXED);
 
-	addMessage(user, " left the room");
+	pthread_mutex_lock(&unsyncedLock);
+	ROOM * room = unsyncedRooms;
+	unsyncedRooms = NULL;
+	pthread_mutex_unlock(&unsyncedLock);
 
-	const char * msg =  "OK\r\n";
-	write(fd, msg, strlen(msg));
-	close(fd);
+	while (room != NULL) {
+		pthread_mutex_lock(&room->lock);
+		ROOM * next = room->nextUnsynced;
+		room->unsynced = 0;
+		mlog_sync(room->messages);
+		pthread_mutex_unlock(&room->lock);
+		room = next;
+	}
 }
 
-void addMessage(char * user, char * message) {
-	if (messages[lastMessage].user=NULL) {
-		free(messages[lastMessage].user);
-		free(messages[lastMessage].message);
+// Remove the expired sessions, at most once a second
+void expireSessions() {
+	time_t now = time(NULL);
+	if (__atomic_load_n(&sessionsExpired, __ATOMIC_RELAXED) == now) {
+		return;
 	}
-	
-	messages[lastMessage].user = strdup(user);
-	messages[lastMessage].message = strdup(message);
-	messages[lastMessage].messageNum = messageNum;
-	lastMessage = ((lastMessage +1) % MAX_MESSAGES);
-	messageNum++;
+	__atomic_store_n(&sessionsExpired, now, __ATOMIC_RELAXED);
+
+	pthread_rwlock_wrlock(&sessionsLock);
+	sessions_expire(sessions, now);
+	pthread_rwlock_unlock(&sessionsLock);
 }
 
-void sendMessage(int fd, char * user, char * password, char * args)
-{
-	if (!checkPassword(fd, user, password)) {
+// Close the connections of the worker that did not read their output
+// for writeTimeout seconds, or sent nothing for idleTimeout seconds.
+// The connections are looked at once a second.
+void reapConnections(WORKER * worker) {
+	time_t now = time(NULL);
+	if (now == worker->lastReap) {
 		return;
 	}
+	worker->lastReap = now;
 
-	if (llist_lookup(usersInRoom, user)==NULL) {
-		const char * msg =  "DENIED (not in room)\r\n";
-		write(fd, msg, strlen(msg));
-		close(fd);
-	}
-	
-	char * message = args;
+	CONNECTION * conn = worker->conns;
+	while (conn != NULL) {
+		CONNECTION * next = conn->nextConn;
 
-	addMessage(user, message);
+		pthread_mutex_lock(&conn->lock);
+		// A GET-MESSAGES answer waits for the client, not in the output
+		int pending = pendingBytes(conn) > 0 || conn->historyRoom != NULL;
+		// Times are in whole seconds: wait one more to be sure
+		int stalled = writeTimeout > 0 && pending &&
+			now - conn->outputSince > writeTimeout;
+		int idle = idleTimeout > 0 && !pending &&
+			conn->subscription == NULL &&
+			now - conn->lastInput > idleTimeout;
+		pthread_mutex_unlock(&conn->lock);
 
-	const char * msg =  "OK\r\n";
-	write(fd, msg, strlen(msg));
-	close(fd);
+		if (stalled || idle) {
+			COUNT(worker->stats.timedOut, 1);
+			logPrintf(LOG_COMMANDS, "connection %d %s\n", conn->fd,
+				  stalled ? "not reading" : "idle");
+			closeConnection(conn);
+		}
+		conn = next;
+	}
 }
 
-void getMessages(int fd, char * user, char * password, char * args)
-{
-	if (!checkPassword(fd, user, password)) {
-		return;
+// Run the command of a job back from a hasher, and the commands of the
+// connection that came after it
+void finishHash(HASH_JOB * job) {
+	CONNECTION * conn = job->conn;
+	if (conn != NULL) {
+		conn->job = NULL;
+		currentJob = job;
+		runCommand(conn->fd, job->command, job->user, job->password,
+			   job->args, &job->start);
+		currentJob = NULL;
+		if (!serviceConnection(conn)) {
+			closeConnection(conn);
+		}
 	}
+	free(job->hash);
+	free(job);
+}
 
-	if (llist_lookup(usersInRoom, user)==NULL) {
-		const char * msg =  "DENIED (not in room)\r\n";
-		write(fd, msg, strlen(msg));
-		close(fd);
+void startWorker(WORKER * worker, int port) {
+	worker->masterSocket = open_server_socket(port);
+	if (setNonBlocking(worker->masterSocket) < 0) {
+		perror("fcntl");
+		exit( -1 );
 	}
-	
-	int messageNumFrom;
-	sscanf(args, "%d", &messageNumFrom);
 
-	int i;
-	int j = lastMessage;
-	int k = 0;
-	for ( i=0; i<MAX_MESSAGES; i++) {
-		if (messages[j].user != NULL && messages[j].messageNum > messageNumFrom) {
-			char msgNum[20];
-			sprintf(msgNum, "%d", messages[j].messageNum);
-			write(fd, msgNum, strlen(msgNum));
-			write(fd, " ", 1 );
-			write(fd, messages[j].user, strlen(messages[j].user));
-			write(fd, " ", 1 );
-			write(fd, messages[j].message, strlen(messages[j].message));
-			write(fd, "\r\n", 2 );
-			k++;
-		}
-		j = (j+1)%MAX_MESSAGES;
-	}
-
-	if (k==0) {
-		// No new messages
-		const char * msg =  "NO-NEW-MESSAGES\r\n";
-		write(fd, msg, strlen(msg));
-		close(fd);
-		return;
+	worker->epollFd = epoll_create1(0);
+	worker->eventFd = eventfd(0, EFD_NONBLOCK);
+	if (worker->epollFd < 0 || worker->eventFd < 0) {
+		perror("epoll_create1");
+		exit( -1 );
 	}
-	write(fd, "\r\n", 2);
-	
-	close(fd);
-}
+	pthread_mutex_init(&worker->dirtyLock, NULL);
+
+	// The master socket is registered without a connection, and the
+	// event fd with the worker
+	struct epoll_event event;
+	event.events = EPOLLIN | EPOLLET;
+	event.data.ptr = NULL;
+	if (epoll_ctl(worker->epollFd, EPOLL_CTL_ADD, worker->masterSocket, &event) < 0) {
+		perror("epoll_ctl");
+		exit( -1 );
+	}
+	event.events = EPOLLIN;
+	event.data.ptr = worker;
+	if (epoll_ctl(worker->epollFd, EPOLL_CTL_ADD, worker->eventFd, &event) < 0) {
+		perror("epoll_ctl");
+		exit( -1 );
+	}
+}
+
+void * runWorker(void * arg) {
+	WORKER * worker = (WORKER *) arg;
+	currentWorker = worker;
+
+	struct epoll_event events[ MAX_EVENTS ];
+	while ( 1 ) {
+		// Wake up now and then to collect a compaction, to sync the
+		// rooms, and to close the connections that timed out
+		pthread_mutex_lock(&journalLock);
+		int timeout = passwordJournal.compacting ? 100 : -1;
+		pthread_mutex_unlock(&journalLock);
+		if (timeout < 0 && (writeTimeout > 0 || idleTimeout > 0 ||
+				    messageDirectory != NULL)) {
+			timeout = 1000;
+		}
+
+		int nevents = epoll_wait(worker->epollFd, events, MAX_EVENTS, timeout);
+		if (nevents < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("epoll_wait");
+			exit( -1 );
+		}
+
+		int i;
+		for (i = 0; i < nevents; i++) {
+			if (events[i].data.ptr == NULL) {
+				acceptConnections(worker);
+				continue;
+			}
+			if (events[i].data.ptr == worker) {
+				// Pushed messages are sent below
+				uint64_t count;
+				if (read(worker->eventFd, &count, sizeof(count)) < 0 &&
+				    errno != EAGAIN) {
+					perror("eventfd");
+				}
+				continue;
+			}
+
+			// Read first: the client may have sent its last commands
+			// just before hanging up
+			CONNECTION * conn = (CONNECTION *) events[i].data.ptr;
+			if (!serviceConnection(conn) ||
+			    (events[i].events & (EPOLLHUP | EPOLLERR))) {
+				closeConnection(conn);
+			}
+		}
+
+		// Run the commands whose password is hashed
+		pthread_mutex_lock(&worker->dirtyLock);
+		HASH_JOB * job = worker->hashed;
+		worker->hashed = NULL;
+		pthread_mutex_unlock(&worker->dirtyLock);
+		while (job != NULL) {
+			HASH_JOB * next = job->next;
+			finishHash(job);
+			job = next;
+		}
+
+		// Send the messages pushed to subscribers in this round
+		while ( 1 ) {
+			pthread_mutex_lock(&worker->dirtyLock);
+			CONNECTION * conn = worker->dirty;
+			if (conn != NULL) {
+				worker->dirty = conn->nextDirty;
+				conn->dirty = 0;
+			}
+			pthread_mutex_unlock(&worker->dirtyLock);
+
+			if (conn == NULL) {
+				break;
+			}
+			if (sendOutput(conn) < 0) {
+				closeConnection(conn);
+			}
+		}
+
+		// One sync for all the users added in this round
+		maintainPasswords();
+		syncRooms();
+		expireSessions();
+		reapConnections(worker);
+	}
+	return NULL;
+}
+
+int
+main( int argc, char ** argv )
+{
+	int c;
+	while ( (c = getopt(argc, argv, "t:m:b:o:w:i:s:p:a:d:")) != -1 ) {
+		switch (c) {
+		case 'a':
+			adminUser = optarg;
+			break;
+		case 'p':
+			nHashers = atoi(optarg);
+			break;
+		case 'o':
+			maxOutput = atol(optarg);
+			break;
+		case 's':
+			messageDirectory = optarg;
+			break;
+		case 'w':
+			writeTimeout = atoi(optarg);
+			break;
+		case 'i':
+			idleTimeout = atoi(optarg);
+			break;
+		case 'd':
+			logLevel = atoi(optarg);
+			break;
+		case 't':
+			nWorkers = atoi(optarg);
+			break;
+		case 'm':
+			maxMessages = atoi(optarg);
+			break;
+		case 'b':
+			maxMessageBytes = atol(optarg);
+			break;
+		default:
+			fprintf( stderr, "%s", usage );
+			exit( -1 );
+		}
+	}
+
+	// Print usage if not enough arguments
+	if ( optind >= argc || nWorkers < 1 || nHashers < 1 ) {
+		fprintf( stderr, "%s", usage );
+		exit( -1 );
+	}
+	
+	// Get the port from the arguments
+	int port = atoi( argv[optind] );
+
+	time(&startTime);
+	if (logLevel > 0) {
+		// The server is stopped with a signal: print each line as it
+		// comes
+		setvbuf(stdout, NULL, _IOLBF, 0);
+	}
+	if (N_COMMANDS >= MAX_COMMANDS) {
+		fprintf(stderr, "Increase MAX_COMMANDS\n");
+		exit( -1 );
+	}
+
+	// Clients that disconnect while we write to them must not kill us
+	signal(SIGPIPE, SIG_IGN);
+
+	// Allow as many open connections as the hard limit does
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+		limit.rlim_cur = limit.rlim_max;
+		if (limit.rlim_cur > MAX_CONNECTIONS) {
+			limit.rlim_cur = MAX_CONNECTIONS;
+		}
+		setrlimit(RLIMIT_NOFILE, &limit);
+		getrlimit(RLIMIT_NOFILE, &limit);
+		maxConnections = limit.rlim_cur;
+	}
+	else {
+		maxConnections = 1024;
+	}
+	connections = (CONNECTION **) calloc(maxConnections, sizeof(CONNECTION *));
+	workers = (WORKER *) calloc(nWorkers, sizeof(WORKER));
+	if (connections == NULL || workers == NULL) {
+		perror("calloc");
+		exit( -1 );
+	}
+
+	initialize();
+
+	int i;
+	for (i = 0; i < nHashers; i++) {
+		pthread_t thread;
+		int error = pthread_create(&thread, NULL, runHasher, NULL);
+		if (error) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(error));
+			exit( -1 );
+		}
+	}
+	for (i = 0; i < nWorkers; i++) {
+		startWorker(&workers[i], port);
+	}
+	for (i = 1; i < nWorkers; i++) {
+		int error = pthread_create(&workers[i].thread, NULL,
+					   runWorker, &workers[i]);
+		if (error) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(error));
+			exit( -1 );
+		}
+	}
+	runWorker(&workers[0]);
+}
+
+//
+// Commands:
+//   Commands are started y the client.
+//
+//   A connection can carry any number of commands, which are answered in
+//   order. The server closes it once the client has shut down its side
+//   and all its commands have been answered.
+//
+//   Request: ADD-USER <USER> <PASSWD>\r\n
+//   Answer: OK\r\n or DENIED\r\n
+//
+//   Request: LOGIN <USER> <PASSWD>\r\n
+//   Answer: OK <TOKEN>\r\n or DENIED\r\n
+//           Every other command accepts the TOKEN in place of <PASSWD>
+//           for an hour, and checks it faster than the password.
+//
+//   Request: LOGOUT <USER> <TOKEN>\r\n
+//   Answer: OK\r\n or DENIED\r\n
+//
+//    REQUEST: GET-ALL-USERS <USER> <PASSWD>\r\n
+//    Answer: USER1\r\n
+//            USER2\r\n
+//            ...
+//            \r\n
+//
+//   Rooms are named #<NAME>. The [#ROOM] argument of the commands below
+//   can be left out to use the default room, #lobby. A message that
+//   starts with # needs an explicit room.
+//
+//   Request: CREATE-ROOM <USER> <PASSWD> #ROOM\r\n
+//   Answer: OK\r\n or DENIED\r\n
+//
+//    REQUEST: LIST-ROOMS <USER> <PASSWD>\r\n
+//    Answer: #ROOM1\r\n
+//            #ROOM2\r\n
+//            ...
+//            \r\n
+//
+//   Request: ENTER-ROOM <USER> <PASSWD> [#ROOM]\r\n
+//   Answer: OK\n or DENIED\r\n
+//
+//   Request: LEAVE-ROOM <USER> <PASSWD> [#ROOM]\r\n
+//   Answer: OK\n or DENIED\r\n
+//
+//   Request: SEND-MESSAGE <USER> <PASSWD> [#ROOM] <MESSAGE>\n
+//   Answer: OK\n or DENIED\n
+//
+//   Request: GET-MESSAGES <USER> <PASSWD> <LAST-MESSAGE-NUM> [#ROOM]\r\n
+//   Answer: MSGNUM1 USER1 MESSAGE1\r\n
+//           MSGNUM2 USER2 MESSAGE2\r\n
+//           MSGNUM3 USER2 MESSAGE2\r\n
+//           ...\r\n
+//           \r\n
+//
+//    REQUEST: GET-USERS-IN-ROOM <USER> <PASSWD> [#ROOM]\r\n
+//    Answer: USER1\r\n
+//            USER2\r\n
+//            ...
+//            \r\n
+//
+//   Request: SUBSCRIBE <USER> <PASSWD> <LAST-MESSAGE-NUM> [#ROOM]\r\n
+//   Answer: OK\r\n or DENIED\r\n
+//           and then, on the same connection, every message of the room
+//           after LAST-MESSAGE-NUM as soon as it is sent:
+//           MSGNUM1 USER1 MESSAGE1\r\n
+//           ...
+//           A connection subscribes to one room at a time. Messages
+//           stop when the user leaves the room or the connection closes.
+//
+//   Request: UNSUBSCRIBE <USER> <PASSWD>\r\n
+//   Answer: OK\r\n
+//
+//   Request: STATS <USER> <PASSWD>\r\n
+//   Answer: <NAME> <VALUE>\r\n
+//           ...
+//           COMMAND <NAME> <COUNT> <P50> <P99> <P999>\r\n
+//           ...
+//           \r\n
+//           or DENIED\r\n
+//           Only the user given with -a can run it. Counters since
+//           the server started, and for every command how many ran and
+//           the upper bound in microseconds of the percentiles of the
+//           time they took.
+//
+
+// Returns 0 if the command waits for a hasher or is still sending its
+// answer, or 1 once it has run
+int
+processRequest( CONNECTION * conn, char * commandLine )
+{
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	STATS * stats = &currentWorker->stats;
+	int fd = conn->fd;
+
+	// Get command
+	char * command = commandLine;
+	char * space = strchr(command, ' ');
+	if (space==NULL) {
+		// No space. Send denied
+		const char * msg =  "ERROR (no command)\r\n";
+		reply(fd, msg, strlen(msg));
+		COUNT(stats->commands[N_COMMANDS], 1);
+		return 1;
+	}
+
+	// Skip space
+	*space = 0;
+	space++;
+
+	logPrintf(LOG_COMMANDS, "command=%s\n", command );
+
+	// Find user
+	char * user = space;
+	space = strchr(space, ' ');
+	if (space==NULL) {
+		// No space. Send denied
+		const char * msg =  "ERROR (no user)\r\n";
+		reply(fd, msg, strlen(msg));
+		COUNT(stats->commands[N_COMMANDS], 1);
+		return 1;
+	}
+	
+	// Skip space
+	*space = 0;
+	space++;
+
+	logPrintf(LOG_COMMANDS, "user=%s\n", user );
+
+	// Find password
+	char * password = space;
+	space = strchr(password, ' ');
+
+	if (space != NULL) {
+		*space = 0;
+		space++;
+	}
+	else {
+		// Skip to end of string
+		space = password + strlen(password);
+	}
+	
+	logPrintf(LOG_COMMANDS, "password=********\n");
+
+	char * args = space;
+	logPrintf(LOG_COMMANDS, "args=%s\n", args );
+
+	int i;
+	for (i = 0; i < N_COMMANDS; i++) {
+		if (!strcmp(command, commandTable[i].name)) {
+			break;
+		}
+	}
+	if (i < N_COMMANDS && needsHash(commandTable[i].password, user, password) &&
+	    hashLater(conn, i, user, password, args, &start)) {
+		return 0;
+	}
+	runCommand(fd, i, user, password, args, &start);
+	return conn->historyRoom == NULL;
+}
+
+// Run the command at position i of the table, or answer an unknown
+// command for N_COMMANDS, and count it with the time since start
+void runCommand(int fd, int i, char * user, char * password,
+		char * args, struct timespec * start)
+{
+	STATS * stats = &currentWorker->stats;
+	if (i < N_COMMANDS) {
+		(*commandTable[i].func)(fd, user, password, args);
+	}
+	else {
+		const char * msg =  "UNKNOWN COMMAND\n";
+		reply(fd, msg, strlen(msg));
+	}
+
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	long elapsed = (end.tv_sec - start->tv_sec) * 1000000L +
+		(end.tv_nsec - start->tv_nsec) / 1000;
+	int bucket = elapsed <= 0 ? 0 : 64 - __builtin_clzl(elapsed);
+	if (bucket >= LATENCY_BUCKETS) {
+		bucket = LATENCY_BUCKETS - 1;
+	}
+	COUNT(stats->commands[i], 1);
+	COUNT(stats->latency[i][bucket], 1);
+
+	// Send OK answer
+	//const char * msg =  "OK\n";
+	//reply(fd, msg, strlen(msg));
+}
+
+//
+// Locking: usersLock protects users, roomsLock the table of rooms, and
+// the lock of a room its users, messages and subscriptions. A worker
+// may lock a room and then a connection, but never two rooms.
+//
+
+//
+// The log of a room is kept in the directory named as the room without
+// its #. Characters other than letters, digits, - and _ are written as
+// %XX, so that a room name cannot reach out of messageDirectory.
+//
+char * roomDirectory(const char * name) {
+	char * path = (char *) malloc(strlen(messageDirectory) + 3 * strlen(name) + 2);
+	if (path == NULL) {
+		return NULL;
+	}
+	char * p = path + sprintf(path, "%s/", messageDirectory);
+	const unsigned char * c;
+	for (c = (const unsigned char *) name + 1; *c != 0; c++) {
+		if (isalnum(*c) || *c == '-' || *c == '_') {
+			*p++ = *c;
+		}
+		else {
+			p += sprintf(p, "%%%02X", *c);
+		}
+	}
+	*p = 0;
+	return path;
+}
+
+// The room name of a directory, that starts with #
+char * directoryRoom(const char * directory) {
+	char * name = (char *) malloc(strlen(directory) + 2);
+	if (name == NULL) {
+		return NULL;
+	}
+	char * p = name;
+	*p++ = '#';
+	while (*directory != 0) {
+		unsigned int c;
+		if (*directory == '%' && sscanf(directory + 1, "%2X", &c) == 1) {
+			*p++ = c;
+			directory += 3;
+		}
+		else {
+			*p++ = *directory++;
+		}
+	}
+	*p = 0;
+	return name;
+}
+
+// The caller holds roomsLock for writing
+ROOM * newRoom(const char * name) {
+	ROOM * room = (ROOM *) malloc(sizeof(ROOM));
+	if (room == NULL) {
+		return NULL;
+	}
+	pthread_mutex_init(&room->lock, NULL);
+	room->name = strdup(name);
+	room->users = htable_create();
+	if (messageDirectory != NULL) {
+		char * directory = roomDirectory(name);
+		room->messages = directory == NULL ? NULL :
+			mlog_open(directory, maxMessages, maxMessageBytes);
+		free(directory);
+	}
+	else {
+		room->messages = mlog_create(maxMessages, maxMessageBytes);
+	}
+	room->subscriptions = NULL;
+	room->unsynced = 0;
+	room->nextUnsynced = NULL;
+	if (room->name == NULL || room->users == NULL ||
+	    room->messages == NULL || htable_insert(rooms, name, room) < 0) {
+		if (room->messages != NULL) {
+			mlog_free(room->messages);
+		}
+		if (room->users != NULL) {
+			htable_free(room->users);
+		}
+		free(room->name);
+		pthread_mutex_destroy(&room->lock);
+		free(room);
+		return NULL;
+	}
+	return room;
+}
+
+// Create the rooms saved in messageDirectory. Their segment files are
+// mapped, not read.
+void loadRooms()
+{
+	if (mkdir(messageDirectory, 0700) < 0 && errno != EEXIST) {
+		perror(messageDirectory);
+		exit(1);
+	}
+
+	DIR * dir = opendir(messageDirectory);
+	if (dir == NULL) {
+		perror(messageDirectory);
+		exit(1);
+	}
+	struct dirent * entry;
+	while ((entry = readdir(dir)) != NULL) {
+		if (entry->d_name[0] == '.' ||
+		    (entry->d_type != DT_DIR && entry->d_type != DT_UNKNOWN)) {
+			continue;
+		}
+		char * name = directoryRoom(entry->d_name);
+		if (name == NULL || strlen(name) > MAX_ROOM_NAME) {
+			printf("Skipping %s/%s\n", messageDirectory, entry->d_name);
+			free(name);
+			continue;
+		}
+		if (newRoom(name) == NULL) {
+			printf("Cannot load room %s\n", name);
+			exit(1);
+		}
+		free(name);
+	}
+	closedir(dir);
+}
+
+void initialize()
+{
+	// Open password file
+	users = htable_create();
+	rooms = htable_create();
+	sessions = sessions_create(SESSION_LIFETIME);
+	if ( users == NULL || rooms == NULL || sessions == NULL ) {
+		printf("Cannot create user tables\n");
+		exit(1);
+	}
+
+	if (!pwjournal_open(&passwordJournal, PASSWORD_FILE,
+			    PASSWORD_SNAPSHOT, users)) {
+		printf("Cannot open %s\n", PASSWORD_FILE);
+		exit(1);
+	}
+
+	if (messageDirectory != NULL) {
+		loadRooms();
+	}
+
+	void * room;
+	if (htable_find(rooms, DEFAULT_ROOM, &room)) {
+		defaultRoom = (ROOM *) room;
+	}
+	else {
+		defaultRoom = newRoom(DEFAULT_ROOM);
+	}
+	if ( defaultRoom == NULL ) {
+		printf("Cannot create room %s\n", DEFAULT_ROOM);
+		exit(1);
+	}
+
+}
+
+// Check the password against its hash, which takes a while, so the
+// users are not locked meanwhile. Only the hashers call it.
+int verifyPassword(char * user, char * password) {
+	void * stored;
+	pthread_rwlock_rdlock(&usersLock);
+	char * hash = NULL;
+	if (htable_find(users, user, &stored)) {
+		hash = strdup((char *) stored);
+	}
+	pthread_rwlock_unlock(&usersLock);
+
+	int ok = hash != NULL && pwjournal_verify(password, hash);
+	free(hash);
+	return ok;
+}
+
+// Whether the password is the token of a session of the user
+int validToken(char * user, char * password) {
+	pthread_rwlock_rdlock(&sessionsLock);
+	int ok = sessions_check(sessions, password, user, time(NULL));
+	pthread_rwlock_unlock(&sessionsLock);
+	return ok;
+}
+
+// Whether the user has a password stored as a hash
+int hashedPassword(char * user) {
+	pthread_rwlock_rdlock(&usersLock);
+	void * stored;
+	int hashed = htable_find(users, user, &stored) &&
+		pwjournal_is_hashed((char *) stored);
+	pthread_rwlock_unlock(&usersLock);
+	return hashed;
+}
+
+// Whether a new user name or password can be stored. The journal keeps
+// them one per line, and commands are split at spaces, so neither can
+// hold whitespace or control characters.
+int validCredential(char * s) {
+	if (*s == 0) {
+		return 0;
+	}
+	for (; *s != 0; s++) {
+		if (isspace((unsigned char) *s) || iscntrl((unsigned char) *s)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// Whether a command, as listed in commandTable, has to wait for a
+// hasher before it runs. No password is kept once it matched, so only a
+// session token spares the hash: clients that send many commands should
+// LOGIN first.
+int needsHash(int kind, char * user, char * password) {
+	switch (kind) {
+	case PASSWORD_CHECK:
+		return !validToken(user, password);
+	case PASSWORD_LOGIN:
+		return 1;
+	case PASSWORD_NEW:
+		// Refused at once otherwise
+		return validCredential(user) && validCredential(password);
+	}
+	return 0;
+}
+
+// Queue the command for the hashers. The connection runs no other
+// command until it is back. Returns 0 if it cannot be queued.
+int hashLater(CONNECTION * conn, int command, char * user, char * password,
+	      char * args, struct timespec * start) {
+	size_t userLength = strlen(user) + 1;
+	size_t passwordLength = strlen(password) + 1;
+	size_t argsLength = strlen(args) + 1;
+	HASH_JOB * job = (HASH_JOB *) malloc(sizeof(HASH_JOB) + userLength +
+					     passwordLength + argsLength);
+	if (job == NULL) {
+		return 0;
+	}
+	job->user = (char *) (job + 1);
+	job->password = job->user + userLength;
+	job->args = job->password + passwordLength;
+	memcpy(job->user, user, userLength);
+	memcpy(job->password, password, passwordLength);
+	memcpy(job->args, args, argsLength);
+	job->worker = conn->worker;
+	job->conn = conn;
+	job->start = *start;
+	job->command = command;
+	job->ok = 0;
+	job->hash = NULL;
+	job->next = NULL;
+	conn->job = job;
+
+	pthread_mutex_lock(&hashLock);
+	if (hashQueue == NULL) {
+		hashQueue = job;
+	}
+	else {
+		hashQueueTail->next = job;
+	}
+	hashQueueTail = job;
+	pthread_cond_signal(&hashReady);
+	pthread_mutex_unlock(&hashLock);
+	return 1;
+}
+
+void * runHasher(void * arg) {
+	while ( 1 ) {
+		pthread_mutex_lock(&hashLock);
+		while (hashQueue == NULL) {
+			pthread_cond_wait(&hashReady, &hashLock);
+		}
+		HASH_JOB * job = hashQueue;
+		hashQueue = job->next;
+		pthread_mutex_unlock(&hashLock);
+
+		int kind = commandTable[job->command].password;
+		if (kind == PASSWORD_NEW) {
+			job->hash = pwjournal_hash(job->password);
+		}
+		else {
+			job->ok = verifyPassword(job->user, job->password);
+			if (job->ok && kind == PASSWORD_LOGIN &&
+			    !hashedPassword(job->user)) {
+				job->hash = pwjournal_hash(job->password);
+			}
+		}
+
+		// Hand it back to the worker of its connection
+		WORKER * worker = job->worker;
+		pthread_mutex_lock(&worker->dirtyLock);
+		int wake = worker->hashed == NULL;
+		job->next = worker->hashed;
+		worker->hashed = job;
+		pthread_mutex_unlock(&worker->dirtyLock);
+
+		if (wake) {
+			uint64_t one = 1;
+			if (write(worker->eventFd, &one, sizeof(one)) < 0) {
+				perror("eventfd");
+			}
+		}
+	}
+	return NULL;
+}
+
+// Whether the password is the one of the user, as checked by the hasher
+// for the command that is running. A command that could not be queued
+// checks it here.
+int passwordMatches(char * user, char * password) {
+	if (currentJob != NULL) {
+		return currentJob->ok;
+	}
+	return verifyPassword(user, password);
+}
+
+// The password can also be the token of a session of the user
+int checkPassword(int fd, char * user, char * password) {
+	if (!validToken(user, password) && !passwordMatches(user, password)) {
+		const char * msg =  "ERROR (Wrong password)\r\n";
+		reply(fd, msg, strlen(msg));
+		return 0;		
+	}
+
+	return 1;
+	
+}
+
+void addUser(int fd, char * user, char * password, char * args)
+{
+	const char * msg =  "OK\r\n";
+
+	if (!validCredential(user) || !validCredential(password)) {
+		msg =  "ERROR (invalid user or password)\r\n";
+		reply(fd, msg, strlen(msg));
+		return;
+	}
+
+	// Made by the hasher, unless the command could not be queued
+	char * hash;
+	if (currentJob != NULL) {
+		hash = currentJob->hash;
+		currentJob->hash = NULL;
+	}
+	else {
+		hash = pwjournal_hash(password);
+	}
+	if (hash == NULL) {
+		msg =  "ERROR (cannot save user)\r\n";
+		reply(fd, msg, strlen(msg));
+		return;
+	}
+
+	pthread_rwlock_wrlock(&usersLock);
+	if (htable_find(users, user, NULL)) {
+		msg =  "ERROR (User Exists)\r\n";
+	}
+	else {
+		pthread_mutex_lock(&journalLock);
+		int saved = pwjournal_append(&passwordJournal, user, hash);
+		pthread_mutex_unlock(&journalLock);
+
+		if (saved) {
+			htable_insert(users, user, hash);
+			hash = NULL;
+		}
+		else {
+			msg =  "ERROR (cannot save user)\r\n";
+		}
+	}
+	pthread_rwlock_unlock(&usersLock);
+	free(hash);
+
+	reply(fd, msg, strlen(msg));
+}
+
+// A user of an older password file logs in: store the hash of the
+// password, made by the hasher, instead of the password itself
+void hashOldPassword(char * user, char * password) {
+	if (currentJob == NULL || currentJob->hash == NULL) {
+		return;
+	}
+	char * hash = currentJob->hash;
+	currentJob->hash = NULL;
+
+	pthread_rwlock_wrlock(&usersLock);
+	void * stored;
+	if (htable_find(users, user, &stored) &&
+	    !pwjournal_is_hashed((char *) stored) &&
+	    !strcmp((char *) stored, password)) {
+		// The journal keeps the last record of a user
+		pthread_mutex_lock(&journalLock);
+		int saved = pwjournal_append(&passwordJournal, user, hash);
+		pthread_mutex_unlock(&journalLock);
+
+		if (saved) {
+			htable_insert(users, user, hash);
+			free(stored);
+			hash = NULL;
+		}
+	}
+	pthread_rwlock_unlock(&usersLock);
+	free(hash);
+}
+
+void login(int fd, char * user, char * password, char * args)
+{
+	// A session needs the password itself, not another token
+	if (!passwordMatches(user, password)) {
+		const char * msg =  "ERROR (Wrong password)\r\n";
+		reply(fd, msg, strlen(msg));
+		return;
+	}
+	hashOldPassword(user, password);
+
+	char token[ SESSION_TOKEN_LENGTH + 1 ];
+	pthread_rwlock_wrlock(&sessionsLock);
+	int ok = sessions_login(sessions, user, time(NULL), token);
+	pthread_rwlock_unlock(&sessionsLock);
+
+	if (!ok) {
+		const char * msg =  "ERROR (cannot log in)\r\n";
+		reply(fd, msg, strlen(msg));
+		return;
+	}
+
+	char answer[ SESSION_TOKEN_LENGTH + 8 ];
+	sprintf(answer, "OK %s\r\n", token);
+	reply(fd, answer, strlen(answer));
+}
+
+void logout(int fd, char * user, char * password, char * args)
+{
+	pthread_rwlock_wrlock(&sessionsLock);
+	int ok = sessions_logout(sessions, password, user);
+	pthread_rwlock_unlock(&sessionsLock);
+
+	const char * msg =  ok ? "OK\r\n" : "DENIED (no such session)\r\n";
+	reply(fd, msg, strlen(msg));
+}
+
+void writeName(const char * name, void * data, void * arg) {
+	int fd = *(int *) arg;
+	reply(fd, name, strlen(name));
+	reply(fd, "\r\n", 2);
+}
+
+//
+// Finds the room named by the #ROOM word at the start of *args, and
+// skips it. Without a room word it returns the default room. If the
+// room does not exist it answers DENIED and returns NULL.
+//
+ROOM * findRoom(int fd, char ** args) {
+	if (**args != '#') {
+		return defaultRoom;
+	}
+
+	char * name = *args;
+	char * space = strchr(name, ' ');
+	if (space != NULL) {
+		*space = 0;
+		*args = space + 1;
+	}
+	else {
+		*args = name + strlen(name);
+	}
+
+	void * room;
+	pthread_rwlock_rdlock(&roomsLock);
+	int found = htable_find(rooms, name, &room);
+	pthread_rwlock_unlock(&roomsLock);
+
+	if (!found) {
+		const char * msg =  "DENIED (no such room)\r\n";
+		reply(fd, msg, strlen(msg));
+		return NULL;
+	}
+	return (ROOM *) room;
+}
+
+// The caller holds the lock of the room
+int checkInRoom(int fd, ROOM * room, char * user) {
+	if (!htable_find(room->users, user, NULL)) {
+		const char * msg =  "DENIED (not in room)\r\n";
+		reply(fd, msg, strlen(msg));
+		return 0;
+	}
+	return 1;
+}
+
+void createRoom(int fd, char * user, char * password, char * args)
+{
+	if (!checkPassword(fd, user, password)) {
+		return;
+	}
+
+	if (args[0] != '#' || args[1] == 0 || strchr(args, ' ') != NULL ||
+	    strlen(args) > MAX_ROOM_NAME) {
+		const char * msg =  "ERROR (room names are #<NAME>)\r\n";
+		reply(fd, msg, strlen(msg));
+		return;
+	}
+
+	const char * msg =  "OK\r\n";
+	pthread_rwlock_wrlock(&roomsLock);
+	if (htable_find(rooms, args, NULL)) {
+		msg =  "DENIED (room exists)\r\n";
+	}
+	else if (newRoom(args) == NULL) {
+		msg =  "ERROR (cannot create room)\r\n";
+	}
+	pthread_rwlock_unlock(&roomsLock);
+
+	reply(fd, msg, strlen(msg));
+}
+
+void listRooms(int fd, char * user, char * password, char * args)
+{
+	if (!checkPassword(fd, user, password)) {
+		return;
+	}
+
+	pthread_rwlock_rdlock(&roomsLock);
+	htable_visit(rooms, writeName, &fd);
+	pthread_rwlock_unlock(&roomsLock);
+	reply(fd, "\r\n", 2);
+}
+
+void enterRoom(int fd, char * user, char * password, char * args)
+{
+	if (!checkPassword(fd, user, password)) {
+		return;
+	}
+
+	ROOM * room = findRoom(fd, &args);
+	if (room == NULL) {
+		return;
+	}
+	
+	pthread_mutex_lock(&room->lock);
+	htable_insert(room->users, user, NULL);
+
+	addMessage(room, user, " entered the room.");
+	pthread_mutex_unlock(&room->lock);
+
+	const char * msg =  "OK\r\n";
+	reply(fd, msg, strlen(msg));
+
+}
+
+void leaveRoom(int fd, char * user, char * password, char * args)
+{
+	if (!checkPassword(fd, user, password)) {
+		return;
+	}
+
+	ROOM * room = findRoom(fd, &args);
+	if (room == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&room->lock);
+	if (checkInRoom(fd, room, user)) {
+		htable_remove(room->users, user);
+
+		// Stop pushing messages to the user
+		SUBSCRIPTION * subscription = room->subscriptions;
+		while (subscription != NULL) {
+			SUBSCRIPTION * next = subscription->next;
+			if (!strcmp(subscription->user, user)) {
+				removeSubscription(subscription);
+			}
+			subscription = next;
+		}
+
+		addMessage(room, user, " left the room");
+
+		const char * msg =  "OK\r\n";
+		reply(fd, msg, strlen(msg));
+	}
+	pthread_mutex_unlock(&room->lock);
+}
+
+// The caller holds the lock of the room
+void addMessage(ROOM * room, char * user, char * message) {
+	if (!mlog_add(room->messages, user, message)) {
+		perror("addMessage");
+		return;
+	}
+	if (messageDirectory != NULL && !room->unsynced) {
+		room->unsynced = 1;
+		pthread_mutex_lock(&unsyncedLock);
+		room->nextUnsynced = unsyncedRooms;
+		unsyncedRooms = room;
+		pthread_mutex_unlock(&unsyncedLock);
+	}
+
+	SUBSCRIPTION * subscription;
+	for (subscription = room->subscriptions; subscription != NULL;
+	     subscription = subscription->next) {
+		pushMessages(subscription);
+	}
+}
+
+void sendMessage(int fd, char * user, char * password, char * args)
+{
+	if (!checkPassword(fd, user, password)) {
+		return;
+	}
+
+	ROOM * room = findRoom(fd, &args);
+	if (room == NULL) {
+		return;
+	}
+	
+	char * message = args;
+
+	pthread_mutex_lock(&room->lock);
+	if (checkInRoom(fd, room, user)) {
+		addMessage(room, user, message);
+
+		const char * msg =  "OK\r\n";
+		reply(fd, msg, strlen(msg));
+	}
+	pthread_mutex_unlock(&room->lock);
+}
+
+void writeLines(const char * lines, int length, void * arg) {
+	int fd = *(int *) arg;
+	reply(fd, lines, length);
+}
+
+void getMessages(int fd, char * user, char * password, char * args)
+{
+	if (!checkPassword(fd, user, password)) {
+		return;
+	}
+
+	int messageNumFrom = 0;
+	sscanf(args, "%d", &messageNumFrom);
+
+	// The room follows the message number
+	args += strcspn(args, " ");
+	args += strspn(args, " ");
+	ROOM * room = findRoom(fd, &args);
+	if (room == NULL) {
+		return;
+	}
+
+	CONNECTION * conn = __atomic_load_n(&connections[fd], __ATOMIC_ACQUIRE);
+	pthread_mutex_lock(&room->lock);
+	if (checkInRoom(fd, room, user)) {
+		MESSAGE_LOG * log = room->messages;
+		int lastNum = log->nextNum - 1;
+		if (lastNum <= messageNumFrom || lastNum < log->firstNum) {
+			// No new messages
+			const char * msg =  "NO-NEW-MESSAGES\r\n";
+			reply(fd, msg, strlen(msg));
+		}
+		else {
+			// Sent by sendHistory, up to the last message now
+			pthread_mutex_lock(&conn->lock);
+			conn->historyRoom = room;
+			conn->historyNum = messageNumFrom;
+			conn->historyLastNum = lastNum;
+			conn->outputSince = time(NULL);
+			pthread_mutex_unlock(&conn->lock);
+		}
+	}
+	pthread_mutex_unlock(&room->lock);
+}
+
+// Lines of the log gathered for one writev()
+typedef struct HISTORY_WRITE {
+	struct iovec iov[ HISTORY_IOVECS ];
+	int count;
+	long length;		// of all the lines visited
+} HISTORY_WRITE;
+
+void gatherLines(const char * lines, int length, void * arg) {
+	HISTORY_WRITE * write = (HISTORY_WRITE *) arg;
+	if (write->count < HISTORY_IOVECS) {
+		write->iov[write->count].iov_base = (void *) lines;
+		write->iov[write->count].iov_len = length;
+		write->count++;
+	}
+	write->length += length;
+}
+
+//
+// Writes the GET-MESSAGES answer to the socket, straight from the lines
+// of the log, as long as the socket takes it. The output is sent first,
+// and stays empty meanwhile since no command runs and nothing is pushed.
+// The log only changes with the room locked, so its lines are written
+// with the lock held. Messages dropped from the log meanwhile are
+// skipped. Returns -1 if the connection is broken.
+//
+int sendHistory(CONNECTION * conn) {
+	if (flushOutput(conn) < 0) {
+		return -1;
+	}
+	if (pendingOutput(conn) > 0) {
+		// Go on once the socket is writable
+		return 0;
+	}
+
+	ROOM * room = conn->historyRoom;
+	pthread_mutex_lock(&room->lock);
+	int done = 0;
+	while ( !done ) {
+		HISTORY_WRITE write;
+		write.count = 0;
+		write.length = 0;
+		int tailLength = conn->historyTailLength - conn->historyTailStart;
+		if (tailLength > 0) {
+			write.iov[0].iov_base = conn->historyTail + conn->historyTailStart;
+			write.iov[0].iov_len = tailLength;
+			write.count = 1;
+		}
+		int last = mlog_visit_after(room->messages, conn->historyNum,
+					    conn->historyLastNum,
+					    HISTORY_CHUNK - tailLength,
+					    gatherLines, &write);
+		if (write.count == 0) {
+			done = 1;
+			break;
+		}
+
+		ssize_t n = writev(conn->fd, write.iov, write.count);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			pthread_mutex_unlock(&room->lock);
+			// else the event loop resumes once it is writable
+			return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+		}
+		COUNT(currentWorker->stats.bytesOut, n);
+		conn->outputSince = time(NULL);
+
+		if (n < tailLength) {
+			conn->historyTailStart += n;
+			continue;
+		}
+		n -= tailLength;
+		conn->historyTailStart = conn->historyTailLength = 0;
+		if (last == 0) {
+			done = 1;
+			break;
+		}
+
+		// Find the line the write stopped in, and keep what is left of
+		// it, which may be dropped from the log before the next write
+		HISTORY_WRITE sent;
+		sent.count = 0;
+		sent.length = 0;
+		last = n == 0 ? conn->historyNum :
+			mlog_visit_after(room->messages, conn->historyNum,
+					 conn->historyLastNum, n, gatherLines, &sent);
+		if (sent.length > n) {
+			int rest = sent.length - n;
+			char * tail = (char *) realloc(conn->historyTail, rest);
+			if (tail == NULL) {
+				pthread_mutex_unlock(&room->lock);
+				perror("sendHistory");
+				return -1;
+			}
+			struct iovec * lastLines = &sent.iov[sent.count - 1];
+			memcpy(tail, (char *) lastLines->iov_base +
+			       lastLines->iov_len - rest, rest);
+			conn->historyTail = tail;
+			conn->historyTailLength = rest;
+		}
+		conn->historyNum = last;
+		done = last == conn->historyLastNum && sent.length == n;
+	}
+	pthread_mutex_unlock(&room->lock);
+
+	// Pushes resume after the end of the answer
+	free(conn->historyTail);
+	conn->historyTail = NULL;
+	pthread_mutex_lock(&conn->lock);
+	conn->historyRoom = NULL;
+	appendOutputLocked(conn, "\r\n", 2);
+	pthread_mutex_unlock(&conn->lock);
+	return flushOutput(conn);
+}
+
+void pushLines(const char * lines, int length, void * arg) {
+	appendOutputLocked((CONNECTION *) arg, lines, length);
+}
+
+// Add the messages after the last one pushed to the output of the
+// subscriber, up to SUBSCRIBER_HIGH_WATER bytes of them, unless it is
+// not reading them or gets a GET-MESSAGES answer. Returns 1 if messages
+// were added. The caller holds the lock of the room.
+int pushMessages(SUBSCRIPTION * subscription) {
+	CONNECTION * conn = subscription->conn;
+	MESSAGE_LOG * log = subscription->room->messages;
+	int last = 0;
+	pthread_mutex_lock(&conn->lock);
+	if (pendingBytes(conn) <= SUBSCRIBER_HIGH_WATER &&
+	    conn->historyRoom == NULL) {
+		last = mlog_visit_after(log, subscription->lastNum,
+					log->nextNum - 1, SUBSCRIBER_HIGH_WATER,
+					pushLines, conn);
+	}
+	pthread_mutex_unlock(&conn->lock);
+	if (last == 0) {
+		return 0;
+	}
+	subscription->lastNum = last;
+	markDirty(conn);
+	return 1;
+}
+
+// The caller holds the lock of the room
+void removeSubscription(SUBSCRIPTION * subscription) {
+	if (subscription->previous != NULL) {
+		subscription->previous->next = subscription->next;
+	}
+	else {
+		subscription->room->subscriptions = subscription->next;
+	}
+	if (subscription->next != NULL) {
+		subscription->next->previous = subscription->previous;
+	}
+
+	CONNECTION * conn = subscription->conn;
+	pthread_mutex_lock(&conn->lock);
+	conn->subscription = NULL;
+	pthread_mutex_unlock(&conn->lock);
+
+	free(subscription->user);
+	free(subscription);
+}
+
+//
+// Returns the subscription of a connection and locks its room, or
+// returns NULL. Only the worker of the connection subscribes it, but
+// any worker may remove the subscription while the room is not locked.
+//
+SUBSCRIPTION * lockSubscription(CONNECTION * conn) {
+	pthread_mutex_lock(&conn->lock);
+	SUBSCRIPTION * subscription = conn->subscription;
+	ROOM * room = subscription != NULL ? subscription->room : NULL;
+	pthread_mutex_unlock(&conn->lock);
+	if (room == NULL) {
+		return NULL;
+	}
+
+	pthread_mutex_lock(&room->lock);
+	pthread_mutex_lock(&conn->lock);
+	int subscribed = conn->subscription == subscription;
+	pthread_mutex_unlock(&conn->lock);
+	if (!subscribed) {
+		// Removed in the meantime
+		pthread_mutex_unlock(&room->lock);
+		return NULL;
+	}
+	return subscription;
+}
+
+void unsubscribeConnection(CONNECTION * conn) {
+	SUBSCRIPTION * subscription = lockSubscription(conn);
+	if (subscription != NULL) {
+		ROOM * room = subscription->room;
+		removeSubscription(subscription);
+		pthread_mutex_unlock(&room->lock);
+	}
+}
+
+// Push what was not pushed while the client was slow. Returns 1 if
+// messages were added to the output.
+int catchUp(CONNECTION * conn) {
+	SUBSCRIPTION * subscription = lockSubscription(conn);
+	int pushed = 0;
+	if (subscription != NULL) {
+		pushed = pushMessages(subscription);
+		pthread_mutex_unlock(&subscription->room->lock);
+	}
+	return pushed;
+}
+
+void subscribe(int fd, char * user, char * password, char * args)
+{
+	if (!checkPassword(fd, user, password)) {
+		return;
+	}
+
+	int messageNumFrom = 0;
+	sscanf(args, "%d", &messageNumFrom);
+
+	// The room follows the message number
+	args += strcspn(args, " ");
+	args += strspn(args, " ");
+	ROOM * room = findRoom(fd, &args);
+	if (room == NULL) {
+		return;
+	}
+
+	// One subscription per connection
+	CONNECTION * conn = __atomic_load_n(&connections[fd], __ATOMIC_ACQUIRE);
+	unsubscribeConnection(conn);
+
+	pthread_mutex_lock(&room->lock);
+	if (!checkInRoom(fd, room, user)) {
+		pthread_mutex_unlock(&room->lock);
+		return;
+	}
+
+	SUBSCRIPTION * subscription =
+		(SUBSCRIPTION *) malloc(sizeof(SUBSCRIPTION));
+	char * name = strdup(user);
+	if (subscription == NULL || name == NULL) {
+		pthread_mutex_unlock(&room->lock);
+		free(subscription);
+		free(name);
+		const char * msg =  "ERROR (cannot subscribe)\r\n";
+		reply(fd, msg, strlen(msg));
+		return;
+	}
+
+	subscription->conn = conn;
+	subscription->room = room;
+	subscription->user = name;
+	subscription->lastNum = messageNumFrom;
+	subscription->previous = NULL;
+	subscription->next = room->subscriptions;
+	if (room->subscriptions != NULL) {
+		room->subscriptions->previous = subscription;
+	}
+	room->subscriptions = subscription;
+	pthread_mutex_lock(&conn->lock);
+	conn->subscription = subscription;
+	pthread_mutex_unlock(&conn->lock);
+
+	const char * msg =  "OK\r\n";
+	reply(fd, msg, strlen(msg));
+
+	// Send what the client missed
+	pushMessages(subscription);
+	pthread_mutex_unlock(&room->lock);
+}
+
+void unsubscribe(int fd, char * user, char * password, char * args)
+{
+	if (!checkPassword(fd, user, password)) {
+		return;
+	}
+
+	unsubscribeConnection(__atomic_load_n(&connections[fd], __ATOMIC_ACQUIRE));
+
+	const char * msg =  "OK\r\n";
+	reply(fd, msg, strlen(msg));
+}
 
 void getUsersInRoom(int fd, char * user, char * password, char * args)
 {
@@ -502,23 +2292,17 @@ void getUsersInRoom(int fd, char * user, char * password, char * args)
 		return;
 	}
 	
-	if (llist_lookup(usersInRoom, user)==NULL) {
-		const char * msg =  "DENIED (not in room)\r\n";
-		write(fd, msg, strlen(msg));
-		close(fd);
+	ROOM * room = findRoom(fd, &args);
+	if (room == NULL) {
+		return;
 	}
 	
-	int nusers = llist_number_elements(usersInRoom);
-	int i;
-	for (i = 0; i < nusers; i++) {
-		char * name;
-		char * pass;
-		llist_get_ith(usersInRoom, i, &name, &pass);
-		write(fd, name, strlen(name));
-		write(fd, "\r\n", 2);
+	pthread_mutex_lock(&room->lock);
+	if (checkInRoom(fd, room, user)) {
+		htable_visit(room->users, writeName, &fd);
+		reply(fd, "\r\n", 2);
 	}
-	write(fd, "\r\n", 2);
-	close(fd);
+	pthread_mutex_unlock(&room->lock);
 }
 
 void getAllUsers(int fd, char * user, char * password, char * args)
@@ -527,16 +2311,124 @@ void getAllUsers(int fd, char * user, char * password, char * args)
 		return;
 	}
 	
-	int nusers = llist_number_elements(users);
-	int i;
-	for (i = 0; i < nusers; i++) {
-		char * name;
-		char * pass;
-		llist_get_ith(users, i, &name, &pass);
-		write(fd, name, strlen(name));
-		write(fd, "\r\n", 2);
+	pthread_rwlock_rdlock(&usersLock);
+	htable_visit(users, writeName, &fd);
+	pthread_rwlock_unlock(&usersLock);
+	reply(fd, "\r\n", 2);
+}
+
+// Adds up the counters of every worker
+void addStats(STATS * total) {
+	memset(total, 0, sizeof(STATS));
+	int w, i, b;
+	for (w = 0; w < nWorkers; w++) {
+		STATS * stats = &workers[w].stats;
+		total->accepted += __atomic_load_n(&stats->accepted, __ATOMIC_RELAXED);
+		total->closed += __atomic_load_n(&stats->closed, __ATOMIC_RELAXED);
+		total->timedOut += __atomic_load_n(&stats->timedOut, __ATOMIC_RELAXED);
+		total->overflowed += __atomic_load_n(&stats->overflowed, __ATOMIC_RELAXED);
+		total->bytesIn += __atomic_load_n(&stats->bytesIn, __ATOMIC_RELAXED);
+		total->bytesOut += __atomic_load_n(&stats->bytesOut, __ATOMIC_RELAXED);
+		for (i = 0; i <= N_COMMANDS; i++) {
+			total->commands[i] +=
+				__atomic_load_n(&stats->commands[i], __ATOMIC_RELAXED);
+			for (b = 0; b < LATENCY_BUCKETS; b++) {
+				total->latency[i][b] +=
+					__atomic_load_n(&stats->latency[i][b], __ATOMIC_RELAXED);
+			}
+		}
+	}
+}
+
+// Upper bound in microseconds of a percentile of a latency histogram
+long percentile(long * histogram, long count, double p) {
+	if (count == 0) {
+		return 0;
+	}
+	long below = 0;
+	int b;
+	for (b = 0; b < LATENCY_BUCKETS - 1; b++) {
+		below += histogram[b];
+		if (below > p * count) {
+			break;
+		}
 	}
-	write(fd, "\r\n", 2);
-	close(fd);
+	return 1L << b;
+}
+
+typedef struct MESSAGE_STATS {
+	long messages;
+	long bytes;
+} MESSAGE_STATS;
+
+void addRoomStats(const char * name, void * data, void * arg) {
+	ROOM * room = (ROOM *) data;
+	MESSAGE_STATS * messageStats = (MESSAGE_STATS *) arg;
+	pthread_mutex_lock(&room->lock);
+	messageStats->messages += mlog_number_messages(room->messages);
+	messageStats->bytes += room->messages->bytes;
+	pthread_mutex_unlock(&room->lock);
+}
+
+void replyStat(int fd, const char * name, long value) {
+	char line[ 128 ];
+	int length = snprintf(line, sizeof(line), "%s %ld\r\n", name, value);
+	reply(fd, line, length);
 }
 
+void stats(int fd, char * user, char * password, char * args)
+{
+	if (!checkPassword(fd, user, password)) {
+		return;
+	}
+	if (adminUser == NULL || strcmp(user, adminUser)) {
+		const char * msg =  "DENIED (not an admin)\r\n";
+		reply(fd, msg, strlen(msg));
+		return;
+	}
+
+	STATS total;
+	addStats(&total);
+
+	pthread_rwlock_rdlock(&usersLock);
+	long nUsers = htable_number_elements(users);
+	pthread_rwlock_unlock(&usersLock);
+
+	pthread_rwlock_rdlock(&sessionsLock);
+	long nSessions = sessions_number(sessions);
+	pthread_rwlock_unlock(&sessionsLock);
+
+	MESSAGE_STATS messageStats = { 0, 0 };
+	pthread_rwlock_rdlock(&roomsLock);
+	long nRooms = htable_number_elements(rooms);
+	htable_visit(rooms, addRoomStats, &messageStats);
+	pthread_rwlock_unlock(&roomsLock);
+
+	replyStat(fd, "UPTIME-SECONDS", time(NULL) - startTime);
+	replyStat(fd, "THREADS", nWorkers);
+	replyStat(fd, "CONNECTIONS-OPEN", total.accepted - total.closed);
+	replyStat(fd, "CONNECTIONS-ACCEPTED", total.accepted);
+	replyStat(fd, "CONNECTIONS-TIMED-OUT", total.timedOut);
+	replyStat(fd, "CONNECTIONS-OVERFLOWED", total.overflowed);
+	replyStat(fd, "BYTES-IN", total.bytesIn);
+	replyStat(fd, "BYTES-OUT", total.bytesOut);
+	replyStat(fd, "USERS", nUsers);
+	replyStat(fd, "SESSIONS", nSessions);
+	replyStat(fd, "ROOMS", nRooms);
+	replyStat(fd, "MESSAGES", messageStats.messages);
+	replyStat(fd, "MESSAGE-BYTES", messageStats.bytes);
+
+	int i;
+	for (i = 0; i <= N_COMMANDS; i++) {
+		long count = total.commands[i];
+		char line[ 256 ];
+		int length = snprintf(line, sizeof(line),
+			"COMMAND %s %ld %ld %ld %ld\r\n",
+			i < N_COMMANDS ? commandTable[i].name : "UNKNOWN", count,
+			percentile(total.latency[i], count, 0.50),
+			percentile(total.latency[i], count, 0.99),
+			percentile(total.latency[i], count, 0.999));
+		reply(fd, line, length);
+	}
+	reply(fd, "\r\n", 2);
+}
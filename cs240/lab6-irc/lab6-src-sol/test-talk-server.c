@@ -11,6 +11,9 @@
 #include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <poll.h>
+#include <errno.h>
 
 char * user;
 char * password;
@@ -78,6 +81,10 @@ int sendCommand(char *  host, int port, char * command, char * response) {
 	write(sock, command, strlen(command));
 	write(sock, "\r\n",2);
 
+	// The server keeps connections open for more commands, so tell it
+	// that this is the last one. It closes the connection once answered.
+	shutdown(sock, SHUT_WR);
+
 	// Keep reading until connection is closed or MAX_REPONSE
 	int n = 0;
 	int len = 0;
@@ -93,10 +100,454 @@ int sendCommand(char *  host, int port, char * command, char * response) {
 	return 1;
 }
 	
+//
+// Load mode: the connections are spread among a few threads, and each
+// connection sends a request, waits for its answer, and sends the next
+// one. The requests follow a mix of commands, or repeat a single command
+// given in the command line. The time from sending a request to reading
+// all its answer is recorded, and at the end the throughput and latency
+// percentiles of every command are printed.
+//
+// The connections are shared by a number of users, named load1, load2,
+// ..., that are added, logged in and entered to the default room before
+// the load starts.
+//
+
+enum { ADD_USER, ENTER_ROOM, SEND_MESSAGE, GET_MESSAGES, COMMAND,
+       REQUEST_TYPES };
+
+// Short name used in the mix, and command sent
+const char * requestNames[ REQUEST_TYPES ][2] = {
+	{ "add", "ADD-USER" },
+	{ "enter", "ENTER-ROOM" },
+	{ "send", "SEND-MESSAGE" },
+	{ "get", "GET-MESSAGES" },
+	{ "command", "COMMAND" },
+};
+
+#define DEFAULT_MIX "enter=1,send=6,get=3"
+#define LOAD_PASSWORD "load"
+
+int loadSeconds = 5;
+int loadConnections = 0;
+int loadThreads = 1;
+int loadUsers = 16;
+int mix[ REQUEST_TYPES ];	// weight of each request
+int mixTotal;
+char * loadCommand;		// the only request, if given
+char ** tokens;			// of the users
+volatile int loadDone;
+
+// Latencies in microseconds
+typedef struct LATENCIES {
+	unsigned int * samples;
+	long count;
+	long capacity;
+	long errors;		// answers that were ERROR or DENIED
+} LATENCIES;
+
+typedef struct LOAD_CONNECTION {
+	int sock;
+	int user;
+	int type;		// of the request waiting for its answer
+	long sent;		// when it was sent, in microseconds
+	int lastNum;		// last message read with GET-MESSAGES
+	char * answer;
+	int answerLength;
+	int answerCapacity;
+} LOAD_CONNECTION;
+
+typedef struct LOAD_THREAD {
+	pthread_t thread;
+	int id;
+	int nConnections;
+	LOAD_CONNECTION * connections;
+	LATENCIES latencies[ REQUEST_TYPES ];
+	unsigned int seed;
+	int usersAdded;
+} LOAD_THREAD;
+
+long microseconds() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+int writeAll(int sock, const char * buffer, int length) {
+	while (length > 0) {
+		int n = write(sock, buffer, length);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return 0;
+		}
+		buffer += n;
+		length -= n;
+	}
+	return 1;
+}
+
+// Reads an answer line into answer. It returns 0 if the connection is
+// closed first.
+int readLine(int sock, char * answer, int size) {
+	int len = 0;
+	int n;
+	while (len < size - 1 && (n = read(sock, answer + len, size - 1 - len)) > 0) {
+		len += n;
+		if (len >= 2 && answer[len-2] == '\r' && answer[len-1] == '\n') {
+			answer[len] = 0;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+void addLatency(LATENCIES * latencies, long latency, int error) {
+	if (latencies->count == latencies->capacity) {
+		latencies->capacity = latencies->capacity == 0 ? 4096 :
+			2 * latencies->capacity;
+		latencies->samples = (unsigned int *) realloc(latencies->samples,
+			latencies->capacity * sizeof(unsigned int));
+		if (latencies->samples == NULL) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	latencies->samples[latencies->count++] = latency;
+	latencies->errors += error;
+}
+
+// Lists (GET-MESSAGES, GET-ALL-USERS, ...) end with an empty line, and
+// the other answers, errors included, are a single line
+int answerComplete(LOAD_CONNECTION * conn) {
+	char * answer = conn->answer;
+	int len = conn->answerLength;
+	if (len < 2 || answer[len-2] != '\r' || answer[len-1] != '\n') {
+		return 0;
+	}
+	int list = conn->type == GET_MESSAGES ||
+		(conn->type == COMMAND && !strncmp(loadCommand, "GET-", 4)) ||
+		(conn->type == COMMAND && !strncmp(loadCommand, "LIST-", 5));
+	if (!list || len == 2 || !strncmp(answer, "ERROR", 5) ||
+	    !strncmp(answer, "DENIED", 6) || !strncmp(answer, "NO-NEW-MESSAGES", 15)) {
+		return 1;
+	}
+	return len >= 4 && answer[len-4] == '\r' && answer[len-3] == '\n';
+}
+
+// The number of the last message of a GET-MESSAGES answer
+void readLastNum(LOAD_CONNECTION * conn) {
+	char * answer = conn->answer;
+	int end = conn->answerLength - 4;	// before the last \r\n\r\n
+	if (end <= 0 || answer[0] < '0' || answer[0] > '9') {
+		return;
+	}
+	int start = end;
+	while (start > 0 && answer[start - 1] != '\n') {
+		start--;
+	}
+	conn->lastNum = atoi(answer + start);
+}
+
+int chooseRequest(LOAD_THREAD * thread) {
+	if (loadCommand != NULL) {
+		return COMMAND;
+	}
+	int r = rand_r(&thread->seed) % mixTotal;
+	int type;
+	for (type = 0; r >= mix[type]; type++) {
+		r -= mix[type];
+	}
+	return type;
+}
+
+int sendRequest(LOAD_THREAD * thread, LOAD_CONNECTION * conn) {
+	char request[ MAX_RESPONSE ];
+	char user[ 32 ];
+	sprintf(user, "load%d", conn->user + 1);
+	char * token = tokens != NULL ? tokens[conn->user] : NULL;
+
+	conn->type = chooseRequest(thread);
+	switch (conn->type) {
+	case ADD_USER:
+		snprintf(request, sizeof(request),
+			 "ADD-USER load%d-%d %s\r\n", thread->id,
+			 ++thread->usersAdded, LOAD_PASSWORD);
+		break;
+	case ENTER_ROOM:
+		snprintf(request, sizeof(request), "ENTER-ROOM %s %s\r\n",
+			 user, token);
+		break;
+	case SEND_MESSAGE:
+		snprintf(request, sizeof(request),
+			 "SEND-MESSAGE %s %s message from %s\r\n",
+			 user, token, user);
+		break;
+	case GET_MESSAGES:
+		snprintf(request, sizeof(request), "GET-MESSAGES %s %s %d\r\n",
+			 user, token, conn->lastNum);
+		break;
+	default:
+		snprintf(request, sizeof(request), "%s\r\n", loadCommand);
+	}
+
+	conn->answerLength = 0;
+	conn->sent = microseconds();
+	return writeAll(conn->sock, request, strlen(request));
+}
+
+// Read what arrived of the answer, and once it is complete send the
+// next request. Returns 0 if the connection was closed.
+int readAnswer(LOAD_THREAD * thread, LOAD_CONNECTION * conn) {
+	if (conn->answerCapacity - conn->answerLength < MAX_RESPONSE) {
+		conn->answerCapacity = conn->answerCapacity == 0 ? 2 * MAX_RESPONSE :
+			2 * conn->answerCapacity;
+		conn->answer = (char *) realloc(conn->answer, conn->answerCapacity);
+		if (conn->answer == NULL) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+
+	int n = read(conn->sock, conn->answer + conn->answerLength,
+		     conn->answerCapacity - conn->answerLength);
+	if (n <= 0) {
+		return n < 0 && errno == EINTR;
+	}
+	conn->answerLength += n;
+	if (!answerComplete(conn)) {
+		return 1;
+	}
+
+	int error = !strncmp(conn->answer, "ERROR", 5) ||
+		!strncmp(conn->answer, "DENIED", 6);
+	addLatency(&thread->latencies[conn->type],
+		   microseconds() - conn->sent, error);
+	if (conn->type == GET_MESSAGES) {
+		readLastNum(conn);
+	}
+
+	return loadDone || sendRequest(thread, conn);
+}
+
+void * runLoad(void * arg) {
+	LOAD_THREAD * thread = (LOAD_THREAD *) arg;
+	struct pollfd * fds = (struct pollfd *)
+		calloc(thread->nConnections, sizeof(struct pollfd));
+
+	int i;
+	for (i = 0; i < thread->nConnections; i++) {
+		fds[i].fd = thread->connections[i].sock;
+		fds[i].events = POLLIN;
+		if (!sendRequest(thread, &thread->connections[i])) {
+			fprintf(stderr, "connection closed by the server\n");
+			fds[i].fd = -1;
+		}
+	}
+
+	while (!loadDone) {
+		if (poll(fds, thread->nConnections, 100) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("poll");
+			exit(1);
+		}
+		for (i = 0; i < thread->nConnections; i++) {
+			if (fds[i].fd >= 0 && fds[i].revents != 0 &&
+			    !readAnswer(thread, &thread->connections[i])) {
+				fprintf(stderr, "connection closed by the server\n");
+				fds[i].fd = -1;
+			}
+		}
+	}
+
+	free(fds);
+	return NULL;
+}
+
+// Add, log in and enter the users of the load, with the tokens in tokens
+void setupUsers() {
+	if (loadCommand != NULL) {
+		return;
+	}
+
+	tokens = (char **) calloc(loadUsers, sizeof(char *));
+	int sock = open_client_socket(host, port);
+	char request[ MAX_RESPONSE ];
+	char answer[ MAX_RESPONSE ];
+
+	int i;
+	for (i = 0; i < loadUsers; i++) {
+		// The user may be left from an earlier run. One request at a
+		// time, so that an answer is a whole read.
+		sprintf(request, "ADD-USER load%d %s\r\n", i + 1, LOAD_PASSWORD);
+		if (!writeAll(sock, request, strlen(request)) ||
+		    !readLine(sock, answer, sizeof(answer))) {
+			fprintf(stderr, "cannot add load%d\n", i + 1);
+			exit(1);
+		}
+		sprintf(request, "LOGIN load%d %s\r\n", i + 1, LOAD_PASSWORD);
+		if (!writeAll(sock, request, strlen(request)) ||
+		    !readLine(sock, answer, sizeof(answer)) ||
+		    strncmp(answer, "OK ", 3)) {
+			fprintf(stderr, "cannot log in load%d\n", i + 1);
+			exit(1);
+		}
+		answer[strcspn(answer, "\r\n")] = 0;
+		tokens[i] = strdup(answer + 3);
+
+		sprintf(request, "ENTER-ROOM load%d %s\r\n", i + 1, tokens[i]);
+		if (!writeAll(sock, request, strlen(request)) ||
+		    !readLine(sock, answer, sizeof(answer))) {
+			fprintf(stderr, "cannot enter load%d\n", i + 1);
+			exit(1);
+		}
+	}
+	close(sock);
+}
+
+int compareSamples(const void * a, const void * b) {
+	unsigned int x = *(const unsigned int *) a;
+	unsigned int y = *(const unsigned int *) b;
+	return x < y ? -1 : x > y;
+}
+
+unsigned int percentile(LATENCIES * latencies, double p) {
+	long i = (long) (p * latencies->count);
+	if (i >= latencies->count) {
+		i = latencies->count - 1;
+	}
+	return latencies->samples[i];
+}
+
+void printLatencies(const char * name, LATENCIES * latencies, double elapsed) {
+	if (latencies->count == 0) {
+		return;
+	}
+	qsort(latencies->samples, latencies->count, sizeof(unsigned int),
+	      compareSamples);
+	printf("%-14s %10ld %10.0f %8u %8u %8u %8u %8ld\n", name,
+	       latencies->count, latencies->count / elapsed,
+	       percentile(latencies, 0.50), percentile(latencies, 0.99),
+	       percentile(latencies, 0.999),
+	       latencies->samples[latencies->count - 1], latencies->errors);
+}
+
+// Merge the latencies of every thread
+void mergeLatencies(LATENCIES * into, LATENCIES * from) {
+	long i;
+	for (i = 0; i < from->count; i++) {
+		addLatency(into, from->samples[i], 0);
+	}
+	into->errors += from->errors;
+}
+
+void load() {
+	setupUsers();
+
+	LOAD_THREAD * threads = (LOAD_THREAD *) calloc(loadThreads, sizeof(LOAD_THREAD));
+	int t, i;
+	for (t = 0; t < loadThreads; t++) {
+		LOAD_THREAD * thread = &threads[t];
+		thread->id = t + 1;
+		thread->seed = time(NULL) + t;
+		thread->nConnections = loadConnections / loadThreads +
+			(t < loadConnections % loadThreads);
+		thread->connections = (LOAD_CONNECTION *)
+			calloc(thread->nConnections, sizeof(LOAD_CONNECTION));
+		for (i = 0; i < thread->nConnections; i++) {
+			LOAD_CONNECTION * conn = &thread->connections[i];
+			conn->sock = open_client_socket(host, port);
+			conn->user = (t + i * loadThreads) % loadUsers;
+		}
+	}
+
+	long start = microseconds();
+	for (t = 0; t < loadThreads; t++) {
+		pthread_create(&threads[t].thread, NULL, runLoad, &threads[t]);
+	}
+	sleep(loadSeconds);
+	loadDone = 1;
+
+	LATENCIES total[ REQUEST_TYPES + 1 ];
+	memset(total, 0, sizeof(total));
+	for (t = 0; t < loadThreads; t++) {
+		pthread_join(threads[t].thread, NULL);
+		int type;
+		for (type = 0; type < REQUEST_TYPES; type++) {
+			mergeLatencies(&total[type], &threads[t].latencies[type]);
+			mergeLatencies(&total[REQUEST_TYPES], &threads[t].latencies[type]);
+		}
+	}
+	double elapsed = (microseconds() - start) / 1000000.0;
+
+	printf("%d connections, %d threads, %.2f s\n",
+	       loadConnections, loadThreads, elapsed);
+	printf("%-14s %10s %10s %8s %8s %8s %8s %8s\n", "command", "requests",
+	       "requests/s", "p50 us", "p99 us", "p999 us", "max us", "errors");
+	// The command word of the command given
+	char commandName[ 32 ];
+	if (loadCommand != NULL) {
+		snprintf(commandName, sizeof(commandName), "%.*s",
+			 (int) strcspn(loadCommand, " "), loadCommand);
+	}
+
+	int type;
+	for (type = 0; type < REQUEST_TYPES; type++) {
+		printLatencies(type == COMMAND ? commandName : requestNames[type][1],
+			       &total[type], elapsed);
+	}
+	printLatencies("total", &total[REQUEST_TYPES], elapsed);
+}
+
+// Parse a mix like "enter=1,send=6,get=3"
+void parseMix(char * spec) {
+	memset(mix, 0, sizeof(mix));
+	mixTotal = 0;
+	char * item;
+	for (item = strtok(spec, ","); item != NULL; item = strtok(NULL, ",")) {
+		char * equal = strchr(item, '=');
+		int weight = equal != NULL ? atoi(equal + 1) : 1;
+		if (equal != NULL) {
+			*equal = 0;
+		}
+
+		int type;
+		for (type = 0; type < COMMAND; type++) {
+			if (!strcasecmp(item, requestNames[type][0]) ||
+			    !strcasecmp(item, requestNames[type][1])) {
+				break;
+			}
+		}
+		if (type == COMMAND || weight < 0) {
+			fprintf(stderr, "Unknown request in mix: %s\n", item);
+			exit(1);
+		}
+		mix[type] = weight;
+		mixTotal += weight;
+	}
+	if (mixTotal == 0) {
+		fprintf(stderr, "Empty mix\n");
+		exit(1);
+	}
+}
+
 void
 printUsage()
 {
 	printf("Usage: test-talk-server host port command\n");
+	printf("       test-talk-server -c connections [-j threads] [-s seconds]\n");
+	printf("                        [-u users] [-m mix] host port [command]\n");
+	printf("\n");
+	printf("With -c, it keeps connections open that send requests one after\n");
+	printf("the other for seconds (default 5), from threads (default 1), and\n");
+	printf("prints the requests/s and the latency percentiles.\n");
+	printf("The requests are the command, or else follow the mix of\n");
+	printf("add, enter, send and get with their weights, for instance\n");
+	printf("\"%s\" (the default). They are sent by users\n", DEFAULT_MIX);
+	printf("load1 ... load<users> (default 16).\n");
 	exit(1);
 }
 
@@ -104,22 +555,54 @@ int
 main(int argc, char **argv) {
 
 	char * command;
-	
-	if (argc < 4) {
+	char defaultMix[] = DEFAULT_MIX;
+	parseMix(defaultMix);
+
+	int opt;
+	while ((opt = getopt(argc, argv, "c:j:s:u:m:")) != -1) {
+		switch (opt) {
+		case 'c':
+			loadConnections = atoi(optarg);
+			break;
+		case 'j':
+			loadThreads = atoi(optarg);
+			break;
+		case 's':
+			loadSeconds = atoi(optarg);
+			break;
+		case 'u':
+			loadUsers = atoi(optarg);
+			break;
+		case 'm':
+			parseMix(optarg);
+			break;
+		default:
+			printUsage();
+		}
+	}
+
+	if (argc - optind < (loadConnections > 0 ? 2 : 3) ||
+	    loadThreads < 1 || loadUsers < 1) {
 		printUsage();
 	}
 
-	host = argv[1];
-	sport = argv[2];
-	command = argv[3];
+	host = argv[optind];
+	sport = argv[optind + 1];
+	command = argv[optind + 2];
 
 	sscanf(sport, "%d", &port);
+
+	if (loadConnections > 0) {
+		loadCommand = command;
+		if (loadThreads > loadConnections) {
+			loadThreads = loadConnections;
+		}
+		load();
+		return 0;
+	}
 	
 	char response[MAX_RESPONSE];
 	sendCommand(host, port, command, response);
 
 	return 0;
 }
-
-
-
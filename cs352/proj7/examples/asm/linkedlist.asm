@@ -0,0 +1,29 @@
+600c0000  RALO(Lb,12)
+54044240  LDLO(L1,16960)
+5804000f  LDHI(L1,15)
+54080002  LDLO(L2,2)
+540c0000  LDLO(L3,0)
+54100001  LDLO(L4,1)
+54140000  LDLO(L5,0)
+54201000  LDLO(L8,4096)
+54240fff  LDLO(L9,4095)
+64002000  BALO(L0,L8,0)
+740c0014  BSET(L3,L0,L5)
+00141410  ADD(L5,L5,L4)
+281423fe  JLT(L5,L8,-2)
+54140000  LDLO(L5,0)
+1c281424  AND(L10,L5,L9)
+64180800  BALO(L6,L2,0)
+702c0028  BGET(L11,L0,L10)
+742c180c  BSET(L11,L6,L3)
+740c1810  BSET(L3,L6,L4)
+74180028  BSET(L6,L0,L10)
+00141410  ADD(L5,L5,L4)
+281407f9  JLT(L5,L1,-7)
+54140000  LDLO(L5,0)
+541c2d00  LDLO(L7,11520)
+581c0131  LDHI(L7,305)
+64180800  BALO(L6,L2,0)
+00141410  ADD(L5,L5,L4)
+28141ffe  JLT(L5,L7,-2)
+500c0000  HALT(L3)
@@ -0,0 +1,61 @@
+#!/bin/bash
+
+if [ $# -lt 1 ]
+then
+  echo "Usage: `basename $0` base-revision [runs]"
+  exit 1
+fi
+
+BASE=$1
+RUNS=${2:-20}
+MEMORY=30000000
+EXAMPLES=`pwd`/../examples/asm
+FLAGS="-std=c11 -fwrapv -O3 -DNDEBUG"
+
+# Calls (CALL and TCAL) made by each run, counted once with an
+# instrumented build. They only depend on the program and its input.
+QUEENS_CALLS=1682232
+BIGNUMS_CALLS=554027
+
+# Both virtual machines are built in a scratch directory, so that bin/vm
+# is left alone. Revisions older than the release target get its flags.
+DIR=`mktemp -d`
+trap "rm -rf $DIR" EXIT
+
+mkdir -p $DIR/base $DIR/current
+git archive $BASE Makefile src | tar -x -C $DIR/base || exit 1
+cp -r Makefile src $DIR/current
+for v in base current
+do
+  make -C $DIR/$v vm CFLAGS="$FLAGS" > /dev/null 2>&1 || { echo "Cannot build $v"; exit 1; }
+done
+
+# Best time in nanoseconds of RUNS runs of each build, run in turns
+bench() {
+  local input=$1 asm=$2 calls=$3
+  local best_base=0 best_current=0
+  for (( i = 0; i < RUNS; i++ ))
+  do
+    for v in base current
+    do
+      local start=`date +%s%N`
+      echo $input | $DIR/$v/bin/vm -m $MEMORY $EXAMPLES/$asm > /dev/null 2>&1
+      local elapsed=$(( `date +%s%N` - start ))
+      if [ $v = base ]
+      then
+        (( best_base == 0 || elapsed < best_base )) && best_base=$elapsed
+      else
+        (( best_current == 0 || elapsed < best_current )) && best_current=$elapsed
+      fi
+    done
+  done
+  printf "%-14s base %6d us  current %6d us  difference %+d ns per call\n" \
+    "$asm ($input)" $(( best_base / 1000 )) $(( best_current / 1000 )) \
+    $(( (best_current - best_base) / calls ))
+}
+
+echo "Best of $RUNS runs, $BASE against the working tree"
+bench 14 queens.asm $QUEENS_CALLS
+bench 800 bignums.asm $BIGNUMS_CALLS
+
+exit 0
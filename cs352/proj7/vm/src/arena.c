@@ -0,0 +1,58 @@
+#define _DEFAULT_SOURCE
+
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "arena.h"
+#include "fail.h"
+
+#define HUGE_PAGE_SIZE ((size_t)2 * 1024 * 1024)
+
+static size_t round_up(size_t value, size_t align) {
+  return (value + align - 1) / align * align;
+}
+
+void* arena_map(size_t size, int huge_pages, size_t* mapped_size) {
+  const int prot = PROT_READ | PROT_WRITE;
+  const int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+
+#ifdef MAP_HUGETLB
+  if (huge_pages) {
+    // reserve the huge pages upfront, so that mapping fails (rather than
+    // faulting later) when the system has too few of them
+    const size_t huge_size = round_up(size, HUGE_PAGE_SIZE);
+    void* start = mmap(NULL, huge_size, prot,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (start != MAP_FAILED) {
+      *mapped_size = huge_size;
+      return start;
+    }
+  }
+#endif
+
+  const size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+  *mapped_size = round_up(size, page_size);
+  void* start = mmap(NULL, *mapped_size, prot, flags, -1, 0);
+  if (start == MAP_FAILED)
+    fail("cannot map %zd bytes of memory", size);
+
+#ifdef MADV_HUGEPAGE
+  if (huge_pages)
+    madvise(start, *mapped_size, MADV_HUGEPAGE);
+#endif
+
+  return start;
+}
+
+void arena_unmap(void* start, size_t mapped_size) {
+  munmap(start, mapped_size);
+}
+
+void arena_release(void* start, void* end) {
+  const uintptr_t page_size = (uintptr_t)sysconf(_SC_PAGESIZE);
+  uintptr_t first = ((uintptr_t)start + page_size - 1) & ~(page_size - 1);
+  uintptr_t last = (uintptr_t)end & ~(page_size - 1);
+  if (first < last)
+    madvise((void*)first, last - first, MADV_DONTNEED);
+}
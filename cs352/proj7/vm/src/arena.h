@@ -0,0 +1,19 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/* Map at least size bytes of zero-filled memory, committed lazily on
+   first touch. With huge_pages, explicit huge pages are tried first,
+   then transparent huge pages are requested. The size actually mapped
+   is stored in mapped_size. */
+void* arena_map(size_t size, int huge_pages, size_t* mapped_size);
+
+/* Unmap memory obtained from arena_map (or any other mapping) */
+void arena_unmap(void* start, size_t mapped_size);
+
+/* Return the pages lying entirely within [start, end) to the system;
+   their content is undefined afterwards */
+void arena_release(void* start, void* end);
+
+#endif // ARENA_H
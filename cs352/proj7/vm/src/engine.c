@@ -1,59 +1,126 @@
+#define _DEFAULT_SOURCE
+
 #include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
 
 #include "vmtypes.h"
 #include "engine.h"
 #include "opcode.h"
 #include "memory.h"
 #include "fail.h"
+#include "snapshot.h"
+#include "trace.h"
+#include "profile.h"
 
 typedef enum {
   Lb, Lb1, Lb2, Lb3, Lb4, Lb5,
   Ib, Ob
 } reg_bank_t;
 
-static void* memory_start;
-static void* memory_end;
+struct engine {
+  void* memory_start;
+  void* memory_end;
+  value_t* R[8];                /* (pseudo)base registers */
+  instr_t* pc;                  /* where engine_run starts or resumes */
+  char* snapshot_file;
+
+  uint64_t max_instructions;    /* per run, 0 for no limit */
+  double max_seconds;           /* per run, 0 for no limit */
+  struct timespec deadline;
+  vm_status_t status;           /* how the last run ended */
+
+  profile_t* profile;           /* NULL when not profiling */
+  uint64_t next_sample;
+};
+
+void engine_setup(vm_t* vm) {
+  engine_t* e = calloc(1, sizeof(engine_t));
+  if (e == NULL)
+    fail("cannot allocate engine");
+  e->memory_start = memory_get_start(vm);
+  e->memory_end = memory_get_end(vm);
+  vm->engine = e;
+
+  engine_set_Lb(vm, e->memory_start);
+  engine_set_Ib(vm, e->memory_start);
+  engine_set_Ob(vm, e->memory_start);
+  engine_set_pc(vm, e->memory_start);
+}
+
+void engine_cleanup(vm_t* vm) {
+  if (vm->engine->profile != NULL)
+    profile_write_and_delete(vm->engine->profile);
+  free(vm->engine);
+  vm->engine = NULL;
+}
+
+void engine_snapshot_at_input(vm_t* vm, char* file_name) {
+  vm->engine->snapshot_file = file_name;
+}
 
-static value_t* R[8];           /* (pseudo)base registers */
+void engine_set_limits(vm_t* vm, uint64_t max_instructions,
+                       double max_seconds) {
+  vm->engine->max_instructions = max_instructions;
+  vm->engine->max_seconds = max_seconds;
+}
 
-void engine_setup(void) {
-  memory_start = memory_get_start();
-  memory_end = memory_get_end();
+vm_status_t engine_get_status(vm_t* vm) {
+  return vm->engine->status;
 }
 
-void engine_cleanup(void) {
-  // nothing to do
+void engine_profile(vm_t* vm, char* file_name) {
+  if (vm->engine->profile == NULL)
+    vm->engine->profile = profile_new(file_name);
 }
 
-void engine_emit(instr_t instr, instr_t** instr_ptr) {
-  if ((void*)(*instr_ptr + 1) > memory_end)
+void engine_emit(vm_t* vm, instr_t instr, instr_t** instr_ptr) {
+  if ((void*)(*instr_ptr + 1) > vm->engine->memory_end)
     fail("not enough memory to load code");
   **instr_ptr = instr;
   *instr_ptr += 1;
 }
 
-value_t* engine_get_Lb(void) { return R[Lb]; }
-value_t* engine_get_Ib(void) { return R[Ib]; }
-value_t* engine_get_Ob(void) { return R[Ob]; }
+value_t* engine_get_Lb(vm_t* vm) { return vm->engine->R[Lb]; }
+value_t* engine_get_Ib(vm_t* vm) { return vm->engine->R[Ib]; }
+value_t* engine_get_Ob(vm_t* vm) { return vm->engine->R[Ob]; }
+
+// The six Lb pseudo-banks are consecutive 32-register windows of the
+// same frame, so their base pointers are computed once per frame switch.
+static inline void set_Lb_banks(value_t** R, value_t* new_value) {
+  R[Lb]  = new_value;
+  R[Lb1] = new_value + 1 * 32;
+  R[Lb2] = new_value + 2 * 32;
+  R[Lb3] = new_value + 3 * 32;
+  R[Lb4] = new_value + 4 * 32;
+  R[Lb5] = new_value + 5 * 32;
+}
 
-void engine_set_Lb(value_t* new_value) {
-  for (reg_bank_t pseudo_bank = Lb; pseudo_bank <= Lb5; ++pseudo_bank)
-    R[pseudo_bank] = new_value + (pseudo_bank - Lb) * 32;
+void engine_set_Lb(vm_t* vm, value_t* new_value) {
+  set_Lb_banks(vm->engine->R, new_value);
+}
+void engine_set_Ib(vm_t* vm, value_t* new_value) {
+  vm->engine->R[Ib] = new_value;
 }
-void engine_set_Ib(value_t* new_value) { R[Ib] = new_value; }
-void engine_set_Ob(value_t* new_value) { R[Ob] = new_value; }
+void engine_set_Ob(vm_t* vm, value_t* new_value) {
+  vm->engine->R[Ob] = new_value;
+}
+
+instr_t* engine_get_pc(vm_t* vm) { return vm->engine->pc; }
+void engine_set_pc(vm_t* vm, instr_t* pc) { vm->engine->pc = pc; }
 
 // Virtual <-> physical address translation
 
-static void* addr_v_to_p(value_t v_addr) {
+static void* addr_v_to_p(engine_t* e, value_t v_addr) {
   assert(0 <= v_addr);
-  return (char*)memory_start + v_addr;
+  return (char*)e->memory_start + v_addr;
 }
 
-static value_t addr_p_to_v(void* p_addr) {
-  assert(memory_start <= p_addr && p_addr <= memory_end);
-  return (value_t)((char*)p_addr - (char*)memory_start);
+static value_t addr_p_to_v(engine_t* e, void* p_addr) {
+  assert(e->memory_start <= p_addr && p_addr <= e->memory_end);
+  return (value_t)((char*)p_addr - (char*)e->memory_start);
 }
 
 // Instruction decoding
@@ -97,13 +164,161 @@ static int instr_d(instr_t instr) {
   return instr_extract_s(instr, 0, 10);
 }
 
+// Static verification
+//
+// Checked once at load time so that the interpreter loop can run without
+// validating instructions: every opcode must be known, every RALO must
+// name the Lb, Ib or Ob bank, every static branch (Jcc, JI) must land in
+// the code area and no instruction may fall through past its end.
+// Register identifiers need no check, as all 8-bit ids decode to one of
+// the eight (pseudo-)banks. CALL, TCAL and RET targets are computed at
+// run time and are not covered.
+
+static int instr_falls_through(opcode_t opcode) {
+  switch (opcode) {
+  case opcode_JI: case opcode_TCAL: case opcode_RET: case opcode_HALT:
+    return 0;
+  default:
+    return 1;
+  }
+}
+
+static int instr_static_target(instr_t instr, int* offset) {
+  opcode_t opcode = instr_opcode(instr);
+  if (opcode_JLT <= opcode && opcode <= opcode_JGT) {
+    *offset = instr_d(instr);
+    return 1;
+  }
+  if (opcode == opcode_JI) {
+    *offset = instr_extract_s(instr, 0, 26);
+    return 1;
+  }
+  return 0;
+}
+
+void engine_verify(vm_t* vm, instr_t* code_end) {
+  instr_t* code_start = vm->engine->memory_start;
+  if (code_end <= code_start)
+    fail("empty program");
+
+  for (instr_t* pc = code_start; pc < code_end; ++pc) {
+    const long addr = pc - code_start;
+    const unsigned int opcode = instr_extract_u(*pc, 26, 6);
+    if (opcode >= OPCODE_COUNT)
+      fail("invalid opcode %u at instruction %ld", opcode, addr);
+
+    if (opcode == opcode_RALO && instr_extract_u(*pc, 24, 2) > 2)
+      fail("invalid register bank in RALO at instruction %ld", addr);
+
+    int offset;
+    if (instr_static_target(*pc, &offset)) {
+      const long target = addr + offset;
+      if (target < 0 || target >= code_end - code_start)
+        fail("branch target %ld out of code at instruction %ld", target, addr);
+    }
+
+    if (pc + 1 == code_end && instr_falls_through((opcode_t)opcode))
+      fail("execution falls off the end of the code at instruction %ld", addr);
+  }
+}
+
 // (Pseudo-)register access
 
 #define Ra (R[reg_bank(instr_ra(*pc))][reg_index(instr_ra(*pc))])
 #define Rb (R[reg_bank(instr_rb(*pc))][reg_index(instr_rb(*pc))])
 #define Rc (R[reg_bank(instr_rc(*pc))][reg_index(instr_rc(*pc))])
 
-#define GOTO_NEXT goto *labels[instr_opcode(*pc)]
+#define GOTO_NEXT do {                          \
+    executed += 1;                              \
+    goto *labels[instr_opcode(*pc)];            \
+  } while (0)
+
+// Run limits and profiling
+//
+// Only backward-capable transfers (conditional and unconditional jumps,
+// calls and tail calls) compare the instruction count to the next check
+// point, so a limit is overshot by at most one straight-line sequence.
+// The clock is only read every DEADLINE_CHECK_INTERVAL instructions, and
+// the call stack is sampled every PROFILE_SAMPLE_INTERVAL instructions
+// (a prime, so that samples do not beat with loops).
+
+#define DEADLINE_CHECK_INTERVAL ((uint64_t)1 << 20)
+#define PROFILE_SAMPLE_INTERVAL ((uint64_t)9973)
+
+#define CHECK_LIMITS do {                                       \
+    if (executed >= next_check                                  \
+        && limits_reached(e, pc, executed, &next_check)) {      \
+      e->pc = pc;                                               \
+      return 0;                                                 \
+    }                                                           \
+  } while (0)
+
+static int deadline_passed(engine_t* e) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec > e->deadline.tv_sec
+    || (now.tv_sec == e->deadline.tv_sec
+        && now.tv_nsec >= e->deadline.tv_nsec);
+}
+
+static uint64_t next_check_point(engine_t* e, uint64_t executed) {
+  uint64_t next = UINT64_MAX;
+  if (e->max_seconds > 0)
+    next = executed + DEADLINE_CHECK_INTERVAL;
+  if (e->max_instructions > 0 && e->max_instructions < next)
+    next = e->max_instructions;
+  if (e->profile != NULL && e->next_sample < next)
+    next = e->next_sample;
+  return next;
+}
+
+static void start_limits(engine_t* e) {
+  e->status = vm_halted;
+  e->next_sample = PROFILE_SAMPLE_INTERVAL;
+  if (e->max_seconds > 0) {
+    clock_gettime(CLOCK_MONOTONIC, &e->deadline);
+    const time_t seconds = (time_t)e->max_seconds;
+    e->deadline.tv_sec += seconds;
+    e->deadline.tv_nsec += (long)((e->max_seconds - (double)seconds) * 1e9);
+    if (e->deadline.tv_nsec >= 1000000000L) {
+      e->deadline.tv_sec += 1;
+      e->deadline.tv_nsec -= 1000000000L;
+    }
+  }
+}
+
+// Walk the input frames from the current one: each holds the address of
+// the instruction following its call site (see CALL)
+static void take_sample(engine_t* e, instr_t* pc) {
+  profile_sample_push(e->profile, addr_p_to_v(e, pc));
+  value_t* frame = e->R[Ib];
+  while (frame != e->memory_start) {
+    profile_sample_push(e->profile, frame[3] - (value_t)sizeof(instr_t));
+    value_t* caller_frame = addr_v_to_p(e, frame[0]);
+    if ((void*)caller_frame >= e->memory_end)
+      break;
+    frame = caller_frame;
+  }
+  profile_sample_end(e->profile);
+}
+
+static int limits_reached(engine_t* e, instr_t* pc, uint64_t executed,
+                          uint64_t* next_check) {
+  if (e->profile != NULL && executed >= e->next_sample) {
+    take_sample(e, pc);
+    e->next_sample = executed + PROFILE_SAMPLE_INTERVAL;
+  }
+  if (e->max_instructions > 0 && executed >= e->max_instructions) {
+    e->status = vm_out_of_instructions;
+    return 1;
+  }
+  if (e->max_seconds > 0 && deadline_passed(e)) {
+    e->status = vm_out_of_time;
+    return 1;
+  }
+  *next_check = next_check_point(e, executed);
+  return 0;
+}
 
 // Floor division and modulus
 // (see "Division and Modulus for Computer Scientists" by Daan Leijen)
@@ -123,13 +338,29 @@ static value_t floorMod(value_t x, value_t y) {
   return rt + i * y;
 }
 
-value_t engine_run() {
-  setbuffer(stdout, NULL, 0);
+// Frame switching
+//
+// On CALL and TCAL the callee starts without local or outgoing frames.
+// Only R[Lb] and R[Ob] are reset (the GC uses memory_start as "no frame"):
+// a callee must RALO its local frame before touching any Lb register, so
+// the derived Lb1..Lb5 pointers are left stale until that RALO refreshes
+// them. RET restores a live caller frame and therefore sets all banks.
+
+static inline void enter_callee(engine_t* e, value_t* callee_Ib) {
+  e->R[Ib] = callee_Ib;
+  e->R[Lb] = e->memory_start;
+  e->R[Ob] = e->memory_start;
+}
+
+value_t engine_run(vm_t* vm) {
+  engine_t* const e = vm->engine;
+  value_t** const R = e->R;
+  instr_t* pc = e->pc;
+  uint64_t executed = 0;
+  start_limits(e);
+  uint64_t next_check = next_check_point(e, executed);
 
-  instr_t* pc = memory_start;
-  engine_set_Lb(memory_start);
-  engine_set_Ib(memory_start);
-  engine_set_Ob(memory_start);
+  setbuffer(vm->out, NULL, 0);
 
   void** labels[OPCODE_COUNT];
   labels[opcode_ADD] = &&l_ADD;
@@ -164,6 +395,10 @@ value_t engine_run() {
   labels[opcode_BSET] = &&l_BSET;
   labels[opcode_BREA] = &&l_BREA;
   labels[opcode_BWRI] = &&l_BWRI;
+  if (e->profile != NULL) {
+    labels[opcode_TCAL] = &&l_TCAL_PROFILED;
+    labels[opcode_CALL] = &&l_CALL_PROFILED;
+  }
 
   GOTO_NEXT;
 
@@ -219,67 +454,86 @@ value_t engine_run() {
 
  l_JLT: {
     pc += (Ra < Rb ? instr_d(*pc) : 1);
+    CHECK_LIMITS;
   } GOTO_NEXT;
 
  l_JLE: {
     pc += (Ra <= Rb ? instr_d(*pc) : 1);
+    CHECK_LIMITS;
   } GOTO_NEXT;
 
  l_JEQ: {
     pc += (Ra == Rb ? instr_d(*pc) : 1);
+    CHECK_LIMITS;
   } GOTO_NEXT;
 
  l_JNE: {
     pc += (Ra != Rb ? instr_d(*pc) : 1);
+    CHECK_LIMITS;
   } GOTO_NEXT;
 
  l_JGE: {
     pc += (Ra >= Rb ? instr_d(*pc) : 1);
+    CHECK_LIMITS;
   } GOTO_NEXT;
 
  l_JGT: {
     pc += (Ra > Rb ? instr_d(*pc) : 1);
+    CHECK_LIMITS;
   } GOTO_NEXT;
 
  l_JI: {
     pc += instr_extract_s(*pc, 0, 26);
+    CHECK_LIMITS;
   } GOTO_NEXT;
 
+ l_TCAL_PROFILED: {
+    profile_function(e->profile, Ra);
+  } goto l_TCAL;
+
+ l_CALL_PROFILED: {
+    profile_function(e->profile, Ra);
+  } goto l_CALL;
+
  l_TCAL: {
-    instr_t* target_pc = addr_v_to_p(Ra);
-    R[Ob][0] = R[Ib][0];
-    R[Ob][1] = R[Ib][1];
-    R[Ob][2] = R[Ib][2];
-    R[Ob][3] = R[Ib][3];
-    engine_set_Ib(R[Ob]);
-    engine_set_Lb(memory_start);
-    engine_set_Ob(memory_start);
+    instr_t* target_pc = addr_v_to_p(e, Ra);
+    value_t* caller_Ib = R[Ib];
+    value_t* callee_Ib = R[Ob];
+    callee_Ib[0] = caller_Ib[0];
+    callee_Ib[1] = caller_Ib[1];
+    callee_Ib[2] = caller_Ib[2];
+    callee_Ib[3] = caller_Ib[3];
+    enter_callee(e, callee_Ib);
     pc = target_pc;
+    CHECK_LIMITS;
   } GOTO_NEXT;
 
  l_CALL: {
-    instr_t* target_pc = addr_v_to_p(Ra);
-    R[Ob][0] = addr_p_to_v(R[Ib]);
-    R[Ob][1] = addr_p_to_v(R[Lb]);
-    R[Ob][2] = addr_p_to_v(R[Ob]);
-    R[Ob][3] = addr_p_to_v(pc + 1);
-    engine_set_Ib(R[Ob]);
-    engine_set_Lb(memory_start);
-    engine_set_Ob(memory_start);
+    instr_t* target_pc = addr_v_to_p(e, Ra);
+    value_t* callee_Ib = R[Ob];
+    callee_Ib[0] = addr_p_to_v(e, R[Ib]);
+    callee_Ib[1] = addr_p_to_v(e, R[Lb]);
+    callee_Ib[2] = addr_p_to_v(e, callee_Ib);
+    callee_Ib[3] = addr_p_to_v(e, pc + 1);
+    enter_callee(e, callee_Ib);
     pc = target_pc;
+    CHECK_LIMITS;
   } GOTO_NEXT;
 
  l_RET: {
-    value_t ret_value = R[Ib][4];
-    instr_t* target_pc = addr_v_to_p(R[Ib][3]);
-    engine_set_Ob(addr_v_to_p(R[Ib][2]));
-    engine_set_Lb(addr_v_to_p(R[Ib][1]));
-    engine_set_Ib(addr_v_to_p(R[Ob][0]));
-    R[Ob][0] = ret_value;
+    value_t* callee_Ib = R[Ib];
+    value_t ret_value = callee_Ib[4];
+    instr_t* target_pc = addr_v_to_p(e, callee_Ib[3]);
+    value_t* caller_Ob = addr_v_to_p(e, callee_Ib[2]);
+    set_Lb_banks(R, addr_v_to_p(e, callee_Ib[1]));
+    R[Ib] = addr_v_to_p(e, caller_Ob[0]);
+    R[Ob] = caller_Ob;
+    caller_Ob[0] = ret_value;
     pc = target_pc;
   } GOTO_NEXT;
 
  l_HALT: {
+    e->pc = pc;
     return Ra;
   }
 
@@ -289,7 +543,9 @@ value_t engine_run() {
   } GOTO_NEXT;
 
  l_LDHI: {
-    Ra = ((value_t)instr_extract_u(*pc, 0, 16) << 16) | (Ra & 0xFFFF);
+    // the loaded constant is 32 bits wide, sign-extend it to a value
+    uint32_t hi = instr_extract_u(*pc, 0, 16);
+    Ra = (value_t)(int32_t)((hi << 16) | ((uint32_t)Ra & 0xFFFF));
     pc += 1;
   } GOTO_NEXT;
 
@@ -300,65 +556,83 @@ value_t engine_run() {
 
  l_RALO: {
     value_t size = (value_t)instr_extract_u(*pc, 16, 8);
-    value_t* block = memory_allocate(tag_RegisterFrame, size);
+    if (vm->trace != NULL)
+      trace_allocation(vm, tag_RegisterFrame, size);
+    value_t* block = memory_allocate(vm, tag_RegisterFrame, size);
     switch (instr_extract_u(*pc, 24, 2)) {
-    case 0: engine_set_Lb(block); break;
-    case 1: engine_set_Ib(block); break;
-    case 2: engine_set_Ob(block); break;
+    case 0: engine_set_Lb(vm, block); break;
+    case 1: engine_set_Ib(vm, block); break;
+    case 2: engine_set_Ob(vm, block); break;
     }
     pc += 1;
   } GOTO_NEXT;
 
  l_BALO: {
-    value_t* block = memory_allocate(instr_extract_u(*pc, 2, 8), Rb);
-    Ra = addr_p_to_v(block);
+    tag_t tag = instr_extract_u(*pc, 2, 8);
+    if (vm->trace != NULL)
+      trace_allocation(vm, tag, Rb);
+    value_t* block = memory_allocate(vm, tag, Rb);
+    Ra = addr_p_to_v(e, block);
     pc += 1;
   } GOTO_NEXT;
 
  l_BSIZ: {
-    Ra = memory_get_block_size(addr_v_to_p(Rb));
+    Ra = memory_get_block_size(addr_v_to_p(e, Rb));
     pc += 1;
   } GOTO_NEXT;
 
  l_BTAG: {
-    Ra = memory_get_block_tag(addr_v_to_p(Rb));
+    Ra = memory_get_block_tag(addr_v_to_p(e, Rb));
     pc += 1;
   } GOTO_NEXT;
 
  l_BGET: {
-    value_t* block = addr_v_to_p(Rb);
+    value_t* block = addr_v_to_p(e, Rb);
     value_t index = Rc;
     assert(0 <= index);
+#ifndef NDEBUG
     if(index >= memory_get_block_size(block)){
-      printf("block: %i\nindex: %i\nsize: %i\n", Rb, index, memory_get_block_size(block));
+      printf("block: %" PRIdVALUE "\nindex: %" PRIdVALUE "\nsize: %" PRIdVALUE "\n", Rb, index, memory_get_block_size(block));
     }
+#endif
     assert(index < memory_get_block_size(block));
     Ra = block[index];
     pc += 1;
   } GOTO_NEXT;
 
  l_BSET: {
-    value_t* block = addr_v_to_p(Rb);
+    value_t* block = addr_v_to_p(e, Rb);
     value_t index = Rc;
     assert(0 <= index);
+#ifndef NDEBUG
     if(index >= memory_get_block_size(block)){
-      printf("pblock: %p\nvblock: %i\nindex: %i\nsize: %i\n", block, Rb, index, memory_get_block_size(block));
+      printf("pblock: %p\nvblock: %" PRIdVALUE "\nindex: %" PRIdVALUE "\nsize: %" PRIdVALUE "\n", block, Rb, index, memory_get_block_size(block));
     }
+#endif
     assert(index < memory_get_block_size(block));
     block[index] = Ra;
     pc += 1;
   } GOTO_NEXT;
 
  l_BREA: {
-    uint8_t byte;
-    size_t read = fread(&byte, sizeof(byte), 1, stdin);
-    Ra = (read == sizeof(byte) ? byte : -1);
+    if (e->snapshot_file != NULL) {
+      e->pc = pc;
+      snapshot_save(vm, e->snapshot_file);
+      e->snapshot_file = NULL;
+    }
+    if (vm->trace != NULL) {
+      Ra = trace_read_byte(vm);
+    } else {
+      uint8_t byte;
+      size_t read = fread(&byte, sizeof(byte), 1, vm->in);
+      Ra = (read == sizeof(byte) ? byte : -1);
+    }
     pc += 1;
   } GOTO_NEXT;
 
  l_BWRI: {
     uint8_t byte = (uint8_t)Ra;
-    fwrite(&byte, sizeof(byte), 1, stdout);
+    fwrite(&byte, sizeof(byte), 1, vm->out);
     pc += 1;
   } GOTO_NEXT;
 }
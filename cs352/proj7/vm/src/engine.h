@@ -2,30 +2,55 @@
 #define ENGINE__H
 
 #include "vmtypes.h"
+#include "vm.h"
 
-/* Setup the interpreter */
-void engine_setup(void);
+/* Setup the interpreter of a VM, whose memory must be setup already */
+void engine_setup(vm_t* vm);
 
 /* Tear down the interpreter */
-void engine_cleanup(void);
+void engine_cleanup(vm_t* vm);
 
 /* Add an instruction to the code area of the memory */
-void engine_emit(instr_t instr, instr_t** instr_ptr);
+void engine_emit(vm_t* vm, instr_t instr, instr_t** instr_ptr);
 
 /* Get the next address in the code area of the memory */
 void* engine_get_next_address(void);
 
 /* Return the heap address of the register bank */
-value_t* engine_get_Lb(void);
-value_t* engine_get_Ib(void);
-value_t* engine_get_Ob(void);
+value_t* engine_get_Lb(vm_t* vm);
+value_t* engine_get_Ib(vm_t* vm);
+value_t* engine_get_Ob(vm_t* vm);
 
 /* Set the heap address of the register bank */
-void engine_set_Lb(value_t* new_value);
-void engine_set_Ib(value_t* new_value);
-void engine_set_Ob(value_t* new_value);
+void engine_set_Lb(vm_t* vm, value_t* new_value);
+void engine_set_Ib(vm_t* vm, value_t* new_value);
+void engine_set_Ob(vm_t* vm, value_t* new_value);
+
+/* Get/set the address at which engine_run starts (or resumes) */
+instr_t* engine_get_pc(vm_t* vm);
+void engine_set_pc(vm_t* vm, instr_t* pc);
+
+/* Check the program in the code area, ending at code_end, and fail if
+   it contains invalid opcodes, banks or static branch targets */
+void engine_verify(vm_t* vm, instr_t* code_end);
+
+/* Save a snapshot of the VM to file_name just before the first byte of
+   input is read, i.e. once the program has finished its initialization */
+void engine_snapshot_at_input(vm_t* vm, char* file_name);
+
+/* Limit the instructions executed and the time spent by each run, 0
+   meaning no limit */
+void engine_set_limits(vm_t* vm, uint64_t max_instructions,
+                       double max_seconds);
+
+/* Tell whether the last run halted or was stopped by a limit */
+vm_status_t engine_get_status(vm_t* vm);
+
+/* Sample the call stack while running, and write the samples as folded
+   stacks to file_name when the engine is cleaned up */
+void engine_profile(vm_t* vm, char* file_name);
 
 /* Interpret the program in the code area of the memory */
-value_t engine_run(void);
+value_t engine_run(vm_t* vm);
 
 #endif // ENGINE__H
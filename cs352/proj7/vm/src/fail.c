@@ -4,10 +4,28 @@
 
 #include "fail.h"
 
+/* Where the failures of each thread go, NULL to terminate the process */
+static _Thread_local jmp_buf* fail_target = NULL;
+static _Thread_local char* fail_message = NULL;
+static _Thread_local size_t fail_message_size = 0;
+
+void fail_catch(jmp_buf* on_fail, char* message, size_t message_size) {
+  fail_target = on_fail;
+  fail_message = message;
+  fail_message_size = message_size;
+}
+
 /* A method to indicate vm failure */
 void fail(char* msg, ...) {
   va_list arg_list;
   va_start(arg_list, msg);
+  if (fail_target != NULL) {
+    jmp_buf* target = fail_target;
+    vsnprintf(fail_message, fail_message_size, msg, arg_list);
+    va_end(arg_list);
+    fail_catch(NULL, NULL, 0);
+    longjmp(*target, 1);
+  }
   fprintf(stderr, "Error: ");
   vfprintf(stderr, msg, arg_list);
   fprintf(stderr, "\n");
@@ -1,7 +1,16 @@
 #ifndef FAIL_H
 #define FAIL_H
 
-/* A method to indicate vm failure */
+#include <stddef.h>
+#include <setjmp.h>
+
+/* A method to indicate vm failure. By default the message is printed and
+   the process exits; see fail_catch. */
 extern void fail(char* msg, ...) __attribute__ ((noreturn));
 
+/* Make the failures of the calling thread format their message into
+   message (of message_size bytes) and jump to on_fail, instead of
+   terminating the process. A NULL on_fail restores the default. */
+extern void fail_catch(jmp_buf* on_fail, char* message, size_t message_size);
+
 #endif // FAIL_H
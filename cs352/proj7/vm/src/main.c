@@ -1,28 +1,50 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <stdalign.h>
-#include <assert.h>
 
 #include "memory.h"
-#include "engine.h"
+#include "vm.h"
 #include "fail.h"
 
 typedef struct {
   size_t memory_size;
+  int huge_pages;
   char* file_name;
+  char* snapshot_save_file;
+  char* snapshot_restore_file;
+  char* trace_record_file;
+  char* trace_replay_file;
+  uint64_t max_instructions;
+  double max_seconds;
+  char* profile_file;
 } options_t;
 
-static options_t default_options = { 1000000, NULL };
+static options_t default_options =
+  { 1000000, 0, NULL, NULL, NULL, NULL, NULL, 0, 0, NULL };
+
+// Exit codes of runs stopped by a limit (as timeout(1) for the deadline)
+#define EXIT_OUT_OF_INSTRUCTIONS 125
+#define EXIT_OUT_OF_TIME 124
 
 // Argument parsing
 
 static void display_usage(char* prog_name) {
   printf("Usage: %s [<options>] <asm_file>\n", prog_name);
+  printf("       %s [<options>] -r <snapshot_file>\n", prog_name);
   printf("\noptions:\n");
   printf("  -h         display this help message and exit\n");
+  printf("  -H         back the memory with huge pages\n");
+  printf("  -i <count> stop after about <count> instructions (exit code %d)\n",
+         EXIT_OUT_OF_INSTRUCTIONS);
   printf("  -m <size>  set memory size in bytes (default %zd)\n",
          default_options.memory_size);
+  printf("  -p <file>  replay the input and collections of a trace file\n");
+  printf("  -P <file>  write a sampled profile as folded stacks to a file\n");
+  printf("  -r <file>  resume execution from a snapshot file\n");
+  printf("  -s <file>  save a snapshot file before the first input read\n");
+  printf("  -t <file>  record the input and collections to a trace file\n");
+  printf("  -T <secs>  stop after about <secs> seconds (exit code %d)\n",
+         EXIT_OUT_OF_TIME);
   printf("  -v         display version and exit\n");
 }
 
@@ -42,6 +64,47 @@ static void parse_args(int argc, char* argv[], options_t* opts) {
         opts->memory_size = strtoul(argv[i++], NULL, 10);
       } break;
 
+      case 'i': {
+        if (i >= argc) {
+          display_usage(argv[0]);
+          fail("missing argument to -i");
+        }
+        opts->max_instructions = strtoull(argv[i++], NULL, 10);
+      } break;
+
+      case 'T': {
+        if (i >= argc) {
+          display_usage(argv[0]);
+          fail("missing argument to -T");
+        }
+        opts->max_seconds = strtod(argv[i++], NULL);
+      } break;
+
+      case 'p':
+      case 'P':
+      case 'r':
+      case 's':
+      case 't': {
+        if (i >= argc) {
+          display_usage(argv[0]);
+          fail("missing argument to %s", arg);
+        }
+        if (arg[1] == 'p')
+          opts->trace_replay_file = argv[i++];
+        else if (arg[1] == 'P')
+          opts->profile_file = argv[i++];
+        else if (arg[1] == 'r')
+          opts->snapshot_restore_file = argv[i++];
+        else if (arg[1] == 's')
+          opts->snapshot_save_file = argv[i++];
+        else
+          opts->trace_record_file = argv[i++];
+      } break;
+
+      case 'H': {
+        opts->huge_pages = 1;
+      } break;
+
       case 'h': {
         display_usage(argv[0]);
         exit(0);
@@ -62,62 +125,55 @@ static void parse_args(int argc, char* argv[], options_t* opts) {
   }
 }
 
-// Memory/size alignment
-
-static size_t align_down(size_t value, size_t align) {
-  assert(align > 0 && (align & (align - 1)) == 0); /* check power of 2 */
-  return value & ~(align - 1);
-}
-
-static void* align_up(void* address, size_t align) {
-  assert(align > 0 && (align & (align - 1)) == 0); /* check power of 2 */
-  uintptr_t int_address = (uintptr_t)address;
-  uintptr_t aligned_address = (int_address + align - 1) & ~(align - 1);
-  return (void*)aligned_address;
-}
-
-// ASM file loading
-
-static void load_file(char* file_name, instr_t** instr_ptr) {
-  FILE* file = fopen(file_name, "r");
-  if (file == NULL)
-    fail("cannot open file %s", file_name);
-
-  char line[1000];
-  while (fgets(line, sizeof(line), file) != NULL) {
-    instr_t instr;
-    int read_count = sscanf(line, "%8x", &instr);
-    if (read_count != 1)
-      fail("error while reading file %s", file_name);
-
-    engine_emit(instr, instr_ptr);
-  }
-
-  fclose(file);
-}
-
 int main(int argc, char* argv[]) {
   options_t options = default_options;
   parse_args(argc, argv, &options);
-  if (options.file_name == NULL) {
-    display_usage(argv[0]);
-    fail("missing input file name");
-  }
-  if (options.memory_size == 0)
-    fail("invalid memory size %zd", options.memory_size);
-
-  const int value_align = alignof(value_t);
-
-  memory_setup(align_down(options.memory_size, value_align));
-  engine_setup();
 
-  instr_t* instr_ptr = memory_get_start();
-  load_file(options.file_name, &instr_ptr);
-  memory_set_heap_start(align_up(instr_ptr, value_align));
-  value_t halt_code = engine_run();
-
-  engine_cleanup();
-  memory_cleanup();
+  vm_t* vm;
+  if (options.snapshot_restore_file != NULL) {
+    vm = vm_new_from_snapshot(options.snapshot_restore_file);
+  } else {
+    if (options.file_name == NULL) {
+      display_usage(argv[0]);
+      fail("missing input file name");
+    }
+    if (options.memory_size == 0)
+      fail("invalid memory size %zd", options.memory_size);
+
+    vm = vm_new(options.file_name, options.memory_size, options.huge_pages);
+  }
 
-  return (int)halt_code;
+  if (options.snapshot_save_file != NULL)
+    vm_snapshot_at_input(vm, options.snapshot_save_file);
+  if (options.trace_record_file != NULL && options.trace_replay_file != NULL)
+    fail("cannot both record and replay a trace");
+  if (options.trace_record_file != NULL)
+    vm_record_trace(vm, options.trace_record_file);
+  if (options.trace_replay_file != NULL)
+    vm_replay_trace(vm, options.trace_replay_file);
+
+  vm_set_limits(vm, options.max_instructions, options.max_seconds);
+  if (options.profile_file != NULL)
+    vm_profile(vm, options.profile_file);
+
+  value_t halt_code = vm_run(vm);
+  vm_status_t status = vm_get_status(vm);
+  if (status == vm_failed) {
+    fflush(vm->out);
+    fprintf(stderr, "Error: %s\n", vm_get_error(vm));
+  }
+  vm_delete(vm);
+
+  switch (status) {
+  case vm_failed:
+    return EXIT_FAILURE;
+  case vm_out_of_instructions:
+    fprintf(stderr, "instruction budget exhausted\n");
+    return EXIT_OUT_OF_INSTRUCTIONS;
+  case vm_out_of_time:
+    fprintf(stderr, "deadline passed\n");
+    return EXIT_OUT_OF_TIME;
+  default:
+    return (int)halt_code;
+  }
 }
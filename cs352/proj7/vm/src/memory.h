@@ -2,7 +2,9 @@
 #define MEMORY_H
 
 #include <stdlib.h>
+#include <sys/types.h>
 #include "vmtypes.h"
+#include "vm.h"
 
 #define GC_NOFREE       0 // the never-free garbage collector
 #define GC_MARK_N_SWEEP 1 // the mark and sweep garbage collector
@@ -12,6 +14,9 @@
 // TODO: change it to GC_MARK_N_SWEEP to test your code.
 #define GC_VERSION GC_MARK_N_SWEEP
 
+/* Block headers pack the size above an 8-bit tag */
+#define MAX_BLOCK_SIZE (VALUE_MAX >> 8)
+
 typedef enum {
   tag_String = 200,
   tag_RegisterFrame = 201,
@@ -22,23 +27,39 @@ typedef enum {
 /* Returns a string identifying the memory system */
 char* memory_get_identity(void);
 
-/* Setup the memory allocator and garbage collector */
-void memory_setup(size_t total_size);
+/* Setup the memory allocator and garbage collector, optionally backing
+   the memory with huge pages */
+void memory_setup(vm_t* vm, size_t total_size, int huge_pages);
 
 /* Tear down the memory */
-void memory_cleanup(void);
+void memory_cleanup(vm_t* vm);
 
 /* Get first memory address */
-void* memory_get_start(void);
+void* memory_get_start(vm_t* vm);
 
 /* Get last memory address */
-void* memory_get_end(void);
+void* memory_get_end(vm_t* vm);
 
 /* Set the heap start, following the code area */
-void memory_set_heap_start(void* heap_start);
+void memory_set_heap_start(vm_t* vm, void* heap_start);
+
+/* Size in bytes of the allocator state saved by memory_save_state */
+size_t memory_get_state_size(void);
+
+/* Save the allocator state (heap bounds, free lists) to a buffer */
+void memory_save_state(vm_t* vm, void* state);
+
+/* Setup the memory by mapping total_size bytes of a snapshot file at
+   offset, and restore the allocator state saved with it */
+void memory_restore(vm_t* vm, int fd, off_t offset, size_t total_size,
+                    const void* state);
 
 /* Allocate block, return physical pointer to the new block */
-value_t* memory_allocate(tag_t tag, value_t size);
+value_t* memory_allocate(vm_t* vm, tag_t tag, value_t size);
+
+/* Collect the garbage now, as memory_allocate does when it runs out of
+   free memory (used to replay the collections of a trace) */
+void memory_collect(vm_t* vm);
 
 /* Unpack block size from a physical pointer */
 value_t memory_get_block_size(value_t* block);
@@ -1,32 +1,61 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <sys/mman.h>
 #include <string.h>
 
 #include "memory.h"
 #include "fail.h"
 #include "engine.h"
+#include "arena.h"
+#include "trace.h"
 
 #if GC_VERSION == GC_MARK_N_SWEEP
 
-static void* memory_start = NULL;
-static void* memory_end = NULL;
+#define FREE_LISTS_COUNT 32
+
+struct memory {
+  void* memory_start;
+  void* memory_end;
+  size_t memory_mapped_size;
 
-static uvalue_t* bitmap_start = NULL;
+  // bit set for every allocated block (maintained on allocation and sweep)
+  uvalue_t* bitmap_start;
+  // bit set for every block reached by the current collection
+  uvalue_t* mark_bitmap_start;
+  size_t bitmap_size;
 
-static value_t* heap_start = NULL;
-static value_t* heap_end = NULL;
-static value_t heap_start_v = 0;
-static value_t heap_end_v = 0;
-static value_t* heap_first_block = NULL;
+  value_t* heap_start;
+  value_t* heap_end;
+  value_t heap_start_v;
+  value_t heap_end_v;
+  value_t* heap_first_block;
 
-#define FREE_LISTS_COUNT 32
-static value_t* free_list_heads[FREE_LISTS_COUNT];
+  value_t* free_list_heads[FREE_LISTS_COUNT];
+
+  // blocks marked but not yet scanned
+  value_t** mark_stack;
+  size_t mark_stack_count;
+  size_t mark_stack_capacity;
+};
 
 #define MIN_BLOCK_SIZE 1
 #define HEADER_SIZE 1
 
+// free blocks at least this large have their pages returned after sweep
+#define RELEASE_MIN_BLOCK_SIZE ((value_t)(64 * 1024 / sizeof(value_t)))
+
+// number of blocks whose headers are prefetched ahead of scanning
+// (1 disables the lookahead)
+#ifndef PREFETCH_RING_SIZE
+#define PREFETCH_RING_SIZE 8
+#endif
+
+#define MARK_STACK_MIN_CAPACITY 1024
+
 // Header management
 
 static value_t header_pack(tag_t tag, value_t size) {
@@ -43,38 +72,38 @@ static value_t header_unpack_size(value_t header) {
 
 // Bitmap management
 
-static int bitmap_is_bit_set(value_t* ptr) {
-  assert(heap_start <= ptr && ptr < heap_end);
-  long index = ptr - heap_start;
+static int bitmap_is_bit_set(memory_t* m, uvalue_t* bitmap, value_t* ptr) {
+  assert(m->heap_start <= ptr && ptr < m->heap_end);
+  long index = ptr - m->heap_start;
   long word_index = index / (long)VALUE_BITS;
   long bit_index = index % (long)VALUE_BITS;
-  return (bitmap_start[word_index] & ((uvalue_t)1 << bit_index)) != 0;
+  return (bitmap[word_index] & ((uvalue_t)1 << bit_index)) != 0;
 }
 
-static void bitmap_set_bit(value_t* ptr) {
-  assert(heap_start <= ptr && ptr < heap_end);
-  long index = ptr - heap_start;
+static void bitmap_set_bit(memory_t* m, uvalue_t* bitmap, value_t* ptr) {
+  assert(m->heap_start <= ptr && ptr < m->heap_end);
+  long index = ptr - m->heap_start;
   long word_index = index / (long)VALUE_BITS;
   long bit_index = index % (long)VALUE_BITS;
-  bitmap_start[word_index] |= (uvalue_t)1 << bit_index;
+  bitmap[word_index] |= (uvalue_t)1 << bit_index;
 }
 
-static void bitmap_clear_bit(value_t* ptr) {
-  assert(heap_start <= ptr && ptr < heap_end);
-  long index = ptr - heap_start;
+static void bitmap_clear_bit(memory_t* m, uvalue_t* bitmap, value_t* ptr) {
+  assert(m->heap_start <= ptr && ptr < m->heap_end);
+  long index = ptr - m->heap_start;
   long word_index = index / (long)VALUE_BITS;
   long bit_index = index % (long)VALUE_BITS;
-  bitmap_start[word_index] &= ~((uvalue_t)1 << bit_index);
+  bitmap[word_index] &= ~((uvalue_t)1 << bit_index);
 }
 
 // Virtual <-> physical address translation
 
-static void* addr_v_to_p(value_t v_addr) {
-  return (char*)memory_start + v_addr;
+static void* addr_v_to_p(memory_t* m, value_t v_addr) {
+  return (char*)m->memory_start + v_addr;
 }
 
-static value_t addr_p_to_v(void* p_addr) {
-  return (value_t)((char*)p_addr - (char*)memory_start);
+static value_t addr_p_to_v(memory_t* m, void* p_addr) {
+  return (value_t)((char*)p_addr - (char*)m->memory_start);
 }
 
 // Free lists management
@@ -93,62 +122,127 @@ char* memory_get_identity() {
   return "mark & sweep garbage collector";
 }
 
-void memory_setup(size_t total_byte_size) {
-  memory_start = malloc(total_byte_size);
-  if (memory_start == NULL)
-    fail("cannot allocate %zd bytes of memory", total_byte_size);
-  memory_end = (char*)memory_start + total_byte_size;
+static memory_t* memory_new(vm_t* vm) {
+  assert(vm->memory == NULL);
+  memory_t* m = calloc(1, sizeof(memory_t));
+  if (m == NULL)
+    fail("cannot allocate memory state");
+  vm->memory = m;
+  return m;
 }
 
-void memory_cleanup() {
-  assert(memory_start != NULL);
-  free(memory_start);
+void memory_setup(vm_t* vm, size_t total_byte_size, int huge_pages) {
+  memory_t* m = memory_new(vm);
+  m->memory_start =
+    arena_map(total_byte_size, huge_pages, &m->memory_mapped_size);
+  m->memory_end = (char*)m->memory_start + total_byte_size;
+}
 
-  memory_start = memory_end = NULL;
-  bitmap_start = NULL;
-  heap_start = heap_end = NULL;
-  heap_start_v = heap_end_v = 0;
-  for (int l = 0; l < FREE_LISTS_COUNT; ++l)
-    free_list_heads[l] = NULL;
+void memory_cleanup(vm_t* vm) {
+  memory_t* m = vm->memory;
+  assert(m != NULL && m->memory_start != NULL);
+  arena_unmap(m->memory_start, m->memory_mapped_size);
+  free(m->mark_stack);
+  free(m);
+  vm->memory = NULL;
 }
 
-void* memory_get_start() {
-  return memory_start;
+void* memory_get_start(vm_t* vm) {
+  return vm->memory->memory_start;
 }
 
-void* memory_get_end() {
-  return memory_end;
+void* memory_get_end(vm_t* vm) {
+  return vm->memory->memory_end;
 }
 
-void memory_set_heap_start(void* ptr) {
-  assert(memory_start <= ptr && ptr < memory_end);
+void memory_set_heap_start(vm_t* vm, void* ptr) {
+  memory_t* m = vm->memory;
+  assert(m->memory_start <= ptr && ptr < m->memory_end);
 
   const size_t bh_size =
-    (size_t)((char*)memory_end - (char*)ptr) / sizeof(value_t);
+    (size_t)((char*)m->memory_end - (char*)ptr) / sizeof(value_t);
 
-  const size_t bitmap_size = (bh_size - 1) / (VALUE_BITS + 1) + 1;
-  const size_t heap_size = bh_size - bitmap_size;
+  // two bitmaps (block starts and marks), each with one bit per heap word
+  const size_t bitmap_size = (bh_size - 1) / (VALUE_BITS + 2) + 1;
+  const size_t heap_size = bh_size - 2 * bitmap_size;
 
-  bitmap_start = ptr;
-  memset(bitmap_start, 0, bitmap_size * sizeof(value_t));
+  m->bitmap_size = bitmap_size;
+  m->bitmap_start = ptr;
+  m->mark_bitmap_start = m->bitmap_start + bitmap_size;
+  memset(m->bitmap_start, 0, 2 * bitmap_size * sizeof(value_t));
 
-  heap_start = (value_t*)bitmap_start + bitmap_size;
-  heap_end = heap_start + heap_size;
-  assert(heap_end == memory_end);
+  m->heap_start = (value_t*)m->mark_bitmap_start + bitmap_size;
+  m->heap_end = m->heap_start + heap_size;
+  assert(m->heap_end == m->memory_end);
 
-  heap_start_v = addr_p_to_v(heap_start);
-  heap_end_v = addr_p_to_v(heap_end);
+  m->heap_start_v = addr_p_to_v(m, m->heap_start);
+  m->heap_end_v = addr_p_to_v(m, m->heap_end);
 
-  heap_first_block = heap_start + HEADER_SIZE;
-  const value_t initial_block_size = (value_t)(heap_end - heap_first_block);
-  heap_first_block[-1] = header_pack(tag_None, initial_block_size);
-  heap_first_block[0] = 0;
+  m->heap_first_block = m->heap_start + HEADER_SIZE;
+  if (m->heap_end - m->heap_first_block > MAX_BLOCK_SIZE)
+    fail("heap of %td words is too large for %d-bit values",
+         m->heap_end - m->heap_first_block, VALUE_WIDTH);
+  const value_t initial_block_size =
+    (value_t)(m->heap_end - m->heap_first_block);
+  m->heap_first_block[-1] = header_pack(tag_None, initial_block_size);
+  m->heap_first_block[0] = 0;
 
   for (int l = 0; l < FREE_LISTS_COUNT - 1; ++l)
-    free_list_heads[l] = memory_start;
-  free_list_heads[FREE_LISTS_COUNT - 1] = heap_first_block;
+    m->free_list_heads[l] = m->memory_start;
+  m->free_list_heads[FREE_LISTS_COUNT - 1] = m->heap_first_block;
 }
 
+// Snapshot support
+
+typedef struct {
+  value_t bitmap_start;
+  value_t mark_bitmap_start;
+  value_t bitmap_size;
+  value_t heap_start;
+  value_t heap_end;
+  value_t heap_first_block;
+  value_t free_list_heads[FREE_LISTS_COUNT];
+} memory_state_t;
+
+size_t memory_get_state_size() {
+  return sizeof(memory_state_t);
+}
+
+void memory_save_state(vm_t* vm, void* state) {
+  memory_t* m = vm->memory;
+  memory_state_t* s = state;
+  s->bitmap_start = addr_p_to_v(m, m->bitmap_start);
+  s->mark_bitmap_start = addr_p_to_v(m, m->mark_bitmap_start);
+  s->bitmap_size = (value_t)m->bitmap_size;
+  s->heap_start = m->heap_start_v;
+  s->heap_end = m->heap_end_v;
+  s->heap_first_block = addr_p_to_v(m, m->heap_first_block);
+  for (int l = 0; l < FREE_LISTS_COUNT; ++l)
+    s->free_list_heads[l] = addr_p_to_v(m, m->free_list_heads[l]);
+}
+
+void memory_restore(vm_t* vm, int fd, off_t offset, size_t total_byte_size,
+                    const void* state) {
+  memory_t* m = memory_new(vm);
+  m->memory_start = mmap(NULL, total_byte_size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE, fd, offset);
+  if (m->memory_start == MAP_FAILED)
+    fail("cannot map %zd bytes of snapshot memory", total_byte_size);
+  m->memory_end = (char*)m->memory_start + total_byte_size;
+  m->memory_mapped_size = total_byte_size;
+
+  const memory_state_t* s = state;
+  m->bitmap_start = addr_v_to_p(m, s->bitmap_start);
+  m->mark_bitmap_start = addr_v_to_p(m, s->mark_bitmap_start);
+  m->bitmap_size = (size_t)s->bitmap_size;
+  m->heap_start = addr_v_to_p(m, s->heap_start);
+  m->heap_end = addr_v_to_p(m, s->heap_end);
+  m->heap_start_v = s->heap_start;
+  m->heap_end_v = s->heap_end;
+  m->heap_first_block = addr_v_to_p(m, s->heap_first_block);
+  for (int l = 0; l < FREE_LISTS_COUNT; ++l)
+    m->free_list_heads[l] = addr_v_to_p(m, s->free_list_heads[l]);
+}
 
 /*
     ██   ██ ███████ ██      ██████  ███████ ██████  ███████
@@ -158,17 +252,17 @@ void memory_set_heap_start(void* ptr) {
     ██   ██ ███████ ███████ ██      ███████ ██   ██ ███████
 */
 
-value_t addToFreeLists(value_t* ptr, value_t size){
-  assert(heap_start <= ptr && ptr < heap_end);
+value_t addToFreeLists(memory_t* m, value_t* ptr, value_t size){
+  assert(m->heap_start <= ptr && ptr < m->heap_end);
   value_t index = free_list_index(size);
-  value_t* prev_head = free_list_heads[index];
-  ptr[0] = addr_p_to_v(prev_head);
-  free_list_heads[index] = ptr;
+  value_t* prev_head = m->free_list_heads[index];
+  ptr[0] = addr_p_to_v(m, prev_head);
+  m->free_list_heads[index] = ptr;
   return index;
 }
 
-int isInHeap(value_t* ptr){
-  if(heap_start <= ptr && ptr < heap_end){
+int isInHeap(memory_t* m, value_t* ptr){
+  if(m->heap_start <= ptr && ptr < m->heap_end){
     return 1;
   }
   return 0;
@@ -181,17 +275,17 @@ int isInHeap(value_t* ptr){
     ██   ██ ██      ██      ██    ██ ██      ██   ██    ██    ██
     ██   ██ ███████ ███████  ██████   ██████ ██   ██    ██    ███████
 */
-value_t* allocate_split_block(value_t realSize, value_t index, int offset, int addToFreeList){
+value_t* allocate_split_block(memory_t* m, value_t realSize, value_t index, int offset, int addToFreeList){
   // printf("Split block\n");
-  value_t* reservedBlock = free_list_heads[index];
+  value_t* reservedBlock = m->free_list_heads[index];
   int isHead = 1;
   if(index == FREE_LISTS_COUNT - 1 && offset > 0){
     // offset for last list
     value_t* prev = reservedBlock;
     isHead = 0;
-    for(int i = 0; i <= offset; i++){
+    for(int i = 0; i < offset; i++){
       prev = reservedBlock;
-      reservedBlock = addr_v_to_p(reservedBlock[0]);
+      reservedBlock = addr_v_to_p(m, reservedBlock[0]);
     }
     // extract reservedBlock from free list
     prev[0] = reservedBlock[0];
@@ -207,71 +301,72 @@ value_t* allocate_split_block(value_t realSize, value_t index, int offset, int a
   leftoverBlock[-1] = header_pack(tag_None, remaining_space);
 
   if(isHead == 1){
-    free_list_heads[index] = addr_v_to_p(reservedBlock[0]);
+    m->free_list_heads[index] = addr_v_to_p(m, reservedBlock[0]);
   }
 
-  if(addToFreeList == 1) addToFreeLists(reservedBlock, realSize);
-  addToFreeLists(leftoverBlock, remaining_space);
+  if(addToFreeList == 1) addToFreeLists(m, reservedBlock, realSize);
+  addToFreeLists(m, leftoverBlock, remaining_space);
   return reservedBlock;
 }
 
-int allocate_find_offset(value_t realSize){
+int allocate_find_offset(memory_t* m, value_t realSize){
   // printf("find offset\n");
   value_t index = FREE_LISTS_COUNT - 1;
-  value_t* tmp = free_list_heads[index];
-  if(tmp == memory_start) return -1;
+  value_t* tmp = m->free_list_heads[index];
+  if(tmp == m->memory_start) return -1;
   value_t blockSize = header_unpack_size(tmp[-1]);
   int ret = 0;
 
-  // find block that is big enough
-  while(blockSize < realSize && tmp != memory_start){
-    tmp = addr_v_to_p(tmp[0]);
-    if(isInHeap(tmp) != 1) break;
+  // find block that is big enough to be split
+  const value_t splitSize = realSize + HEADER_SIZE + MIN_BLOCK_SIZE;
+  while(blockSize < splitSize && tmp != m->memory_start){
+    tmp = addr_v_to_p(m, tmp[0]);
+    if(isInHeap(m, tmp) != 1) break;
     blockSize = header_unpack_size(tmp[-1]);
     ret++;
   }
-  if(tmp == memory_start){
+  if(tmp == m->memory_start){
     return -1;
   }
   return ret;
 }
 
 // exact size only
-value_t* allocate_with_exact(tag_t tag, value_t realSize){
+value_t* allocate_with_exact(memory_t* m, tag_t tag, value_t realSize){
   // printf("allocate exact\n");
-  if(free_list_heads[realSize] != memory_start){
-    value_t* ret = free_list_heads[realSize];
-    free_list_heads[realSize] = addr_v_to_p(ret[0]);
+  if(m->free_list_heads[realSize] != m->memory_start){
+    value_t* ret = m->free_list_heads[realSize];
+    m->free_list_heads[realSize] = addr_v_to_p(m, ret[0]);
     ret[-1] = header_pack(tag, realSize);
 
-    assert(heap_start <= ret && ret < heap_end);
-    bitmap_set_bit(ret);
+    assert(m->heap_start <= ret && ret < m->heap_end);
+    bitmap_set_bit(m, m->bitmap_start, ret);
     return ret;
   }
   return NULL;
 }
 
-value_t* allocate_with_last(tag_t tag, value_t realSize){
+value_t* allocate_with_last(memory_t* m, tag_t tag, value_t realSize){
   // printf("allocate last\n");
-  int offset = allocate_find_offset(realSize);
+  int offset = allocate_find_offset(m, realSize);
   if(offset == -1) return NULL;
-  value_t* ret = allocate_split_block(realSize, FREE_LISTS_COUNT - 1, offset, 0);
+  value_t* ret = allocate_split_block(m, realSize, FREE_LISTS_COUNT - 1, offset, 0);
   ret[-1] = header_pack(tag, realSize);
 
-  assert(heap_start <= ret && ret < heap_end);
-  bitmap_set_bit(ret);
+  assert(m->heap_start <= ret && ret < m->heap_end);
+  bitmap_set_bit(m, m->bitmap_start, ret);
   return ret;
 }
 
-value_t allocate_find_free_list(value_t realSize){
+value_t allocate_find_free_list(memory_t* m, value_t realSize){
   // printf("find free list\n");
   value_t index = free_list_index(realSize);
-  if(free_list_heads[index] != memory_start){
+  if(m->free_list_heads[index] != m->memory_start){
     return index;
   }
   index = realSize + MIN_BLOCK_SIZE + HEADER_SIZE;
   for(; index < FREE_LISTS_COUNT; index += MIN_BLOCK_SIZE){
-    if(free_list_heads[index] != memory_start){
+    if(m->free_list_heads[index] != m->memory_start){
       return index;
     }
   }
@@ -286,50 +381,35 @@ value_t allocate_find_free_list(value_t realSize){
     ██   ██ ███████ ███████  ██████   ██████ ██   ██    ██    ███████     ██████  ██   ██ ███████ ███████
 */
 
-int highest = -1;
-int lowest = 9999999;
-
-static value_t* allocate(tag_t tag, value_t size) {
-  // TODO
+static value_t* allocate(memory_t* m, tag_t tag, value_t size) {
   value_t* ret;
 
-  if(size > highest) {
-    highest = size;
-    printf("highest: %i\n", highest);
-  }
-
-  if(size < lowest) {
-    lowest = size;
-    printf("lowest: %i\n", lowest);
-  }
-
-
   assert(0 <= size);
   value_t realSize = real_size(size);
   assert(MIN_BLOCK_SIZE <= realSize);
 
   if(realSize >= FREE_LISTS_COUNT - 1){
-    ret = allocate_with_last(tag, realSize);
+    ret = allocate_with_last(m, tag, realSize);
   } else {
-    value_t index = allocate_find_free_list(realSize);
+    value_t index = allocate_find_free_list(m, realSize);
     if(index == -1) return NULL;
 
     if(index < FREE_LISTS_COUNT - 1){
       // split block
-      if(index > realSize) allocate_split_block(realSize, index, 0, 1);
-      ret = allocate_with_exact(tag, realSize);
+      if(index > realSize) allocate_split_block(m, realSize, index, 0, 1);
+      ret = allocate_with_exact(m, tag, realSize);
     } else {
-      int offset = allocate_find_offset(realSize);
+      int offset = allocate_find_offset(m, realSize);
       if(offset == -1) return NULL;
-      allocate_split_block(realSize, index, offset, 1);
-      ret = allocate_with_exact(tag, realSize);
+      allocate_split_block(m, realSize, index, offset, 1);
+      ret = allocate_with_exact(m, tag, realSize);
     }
   }
 
   if(ret != NULL)
     assert(memory_get_block_size(ret) >= MIN_BLOCK_SIZE);
 
-  if(size == 0)
+  if(size == 0 && ret != NULL)
     ret[-1] = header_pack(tag, size);
 
   return ret;
@@ -343,25 +423,81 @@ static value_t* allocate(tag_t tag, value_t size) {
     ██      ██ ██   ██ ██   ██ ██   ██
 */
 
-static void mark(value_t* block) {
-  // TODO
-  if(isInHeap(block) != 1) return;
-  bitmap_clear_bit(block);
+// Only values that are the address of an allocated block are traced, so
+// integers that happen to look like (interior or stale) heap addresses
+// are ignored. This also covers the slots of a register frame that still
+// hold words of the block that previously lived there: frames are not
+// cleared on allocation, and such a word can at worst keep a live-looking
+// block until the frame is written or freed.
+static value_t* block_pointer(memory_t* m, value_t v) {
+  if(v < 0 || (v & (value_t)(sizeof(value_t) - 1)) != 0) return NULL;
+  value_t* addr = addr_v_to_p(m, v);
+  if(isInHeap(m, addr) != 1) return NULL;
+  if(!bitmap_is_bit_set(m, m->bitmap_start, addr)) return NULL;
+  return addr;
+}
+
+static int is_marked(memory_t* m, value_t* block) {
+  return bitmap_is_bit_set(m, m->mark_bitmap_start, block);
+}
+
+static void mark_push(memory_t* m, value_t* block) {
+  bitmap_set_bit(m, m->mark_bitmap_start, block);
+  if (m->mark_stack_count == m->mark_stack_capacity) {
+    size_t capacity = m->mark_stack_capacity == 0
+      ? MARK_STACK_MIN_CAPACITY
+      : 2 * m->mark_stack_capacity;
+    value_t** stack = realloc(m->mark_stack, capacity * sizeof(value_t*));
+    if (stack == NULL)
+      fail("cannot grow mark stack to %zu entries", capacity);
+    m->mark_stack = stack;
+    m->mark_stack_capacity = capacity;
+  }
+  m->mark_stack[m->mark_stack_count++] = block;
+}
+
+static void mark_scan(memory_t* m, value_t* block) {
   value_t size = header_unpack_size(block[-1]);
 
   // look at all elements of this block
-  for(int i = 0; i < size; i++){
-    value_t el = block[i];
-    if((el & 0x03) == 0){
-      // value is a virtual address
-      value_t* addr = addr_v_to_p(el);
-      if(isInHeap(addr) == 1 && bitmap_is_bit_set(addr)){
-        mark(addr);
-      }
+  for(value_t i = 0; i < size; i++){
+    value_t* addr = block_pointer(m, block[i]);
+    if(addr != NULL && !is_marked(m, addr)){
+      mark_push(m, addr);
     }
   }
 }
 
+// Blocks popped from the mark stack go through a FIFO ring before being
+// scanned, and their header is prefetched on entry, so that by the time a
+// block is scanned its first cache line is (hopefully) already loaded.
+static void mark(memory_t* m) {
+  value_t* ring[PREFETCH_RING_SIZE];
+  unsigned int ring_head = 0;
+  unsigned int ring_count = 0;
+
+  for(;;){
+    while(ring_count < PREFETCH_RING_SIZE && m->mark_stack_count > 0){
+      value_t* block = m->mark_stack[--m->mark_stack_count];
+      __builtin_prefetch(block - 1, 0, 1);
+      ring[(ring_head + ring_count) % PREFETCH_RING_SIZE] = block;
+      ring_count++;
+    }
+    if(ring_count == 0) break;
+
+    value_t* block = ring[ring_head];
+    ring_head = (ring_head + 1) % PREFETCH_RING_SIZE;
+    ring_count--;
+    mark_scan(m, block);
+  }
+}
+
+static void mark_root(memory_t* m, value_t* root) {
+  if(root == m->memory_start) return;
+  value_t* block = block_pointer(m, addr_p_to_v(m, root));
+  if(block != NULL && !is_marked(m, block)) mark_push(m, block);
+}
+
 /*
     ███████ ██     ██ ███████ ███████ ██████
     ██      ██     ██ ██      ██      ██   ██
@@ -370,85 +506,86 @@ static void mark(value_t* block) {
     ███████  ███ ███  ███████ ███████ ██
 */
 
-static void sweep() {
-
-  printf("%s\n", "sweeping");
+// Return the pages of large free blocks to the system, keeping the
+// header and the free list link (first word) of each block intact.
+static void release_free_blocks(memory_t* m) {
+  value_t* block = m->free_list_heads[FREE_LISTS_COUNT - 1];
+  while (block != m->memory_start) {
+    value_t size = header_unpack_size(block[-1]);
+    if (size >= RELEASE_MIN_BLOCK_SIZE)
+      arena_release(block + 1, block + size);
+    block = addr_v_to_p(m, block[0]);
+  }
+}
 
-  // TODO
-  value_t* ptr = heap_start;
-  value_t* prevFree = memory_start;
+static void sweep(memory_t* m) {
+  value_t* ptr = m->heap_first_block;
+  value_t* prevFree = m->memory_start;
   value_t prevIndex = 0;
   int justFreed = 0;
 
-  for (int l = 0; l < FREE_LISTS_COUNT - 1; ++l){
-    // mark all freelists for freeing
-    value_t* tmp = free_list_heads[l];
-    while(tmp != memory_start){
-      assert(heap_start <= tmp && tmp < heap_end);
-      bitmap_set_bit(tmp);
-      tmp = addr_v_to_p(tmp[0]);
-    }
-    // empty the free lists
-    free_list_heads[l] = memory_start;
-  }
+  // free lists are rebuilt from scratch
+  for (int l = 0; l < FREE_LISTS_COUNT; ++l)
+    m->free_list_heads[l] = m->memory_start;
 
   // look at every block
-  while(ptr != heap_end){
-    if(isInHeap(ptr) == 0){
-      ptr = memory_end;
+  while(ptr < m->heap_end){
+    value_t size = real_size(header_unpack_size(ptr[-1]));
+    value_t* nextAddr = ptr + size + HEADER_SIZE;
+    if(bitmap_is_bit_set(m, m->bitmap_start, ptr) && is_marked(m, ptr)){
+      // live block
+      justFreed = 0;
     } else {
-      value_t size = real_size(header_unpack_size(ptr[-1]));
-      assert(isInHeap(ptr) == 1 || ptr == memory_end);
-      value_t* nextAddr = ptr + size + HEADER_SIZE;
-      if(!bitmap_is_bit_set(ptr)){
-        justFreed = 0;
-        assert(heap_start <= ptr && ptr < heap_end);
-        bitmap_set_bit(ptr);
-      } else {
-        // reset the bit
-        bitmap_clear_bit(ptr);
-
-        // coalescing
-        if(justFreed == 1){
-          // remove previous from its free list
-          free_list_heads[prevIndex] = addr_v_to_p(prevFree[0]);
-          value_t prevSize = header_unpack_size(prevFree[-1]);
-
-          // add block to the previous
-          size = prevSize + size + HEADER_SIZE;
-          prevFree[-1] = header_pack(tag_None, size);
-          ptr = prevFree;
-        }
-        // add to free lists
-        prevIndex = addToFreeLists(ptr, size);
-        prevFree = ptr;
-        justFreed = 1;
+      bitmap_clear_bit(m, m->bitmap_start, ptr);
+
+      // coalescing
+      if(justFreed == 1){
+        // remove previous from its free list
+        m->free_list_heads[prevIndex] = addr_v_to_p(m, prevFree[0]);
+        value_t prevSize = header_unpack_size(prevFree[-1]);
+
+        // add block to the previous
+        size = prevSize + size + HEADER_SIZE;
+        ptr = prevFree;
       }
-      ptr = nextAddr;
+      ptr[-1] = header_pack(tag_None, size);
+      // add to free lists
+      prevIndex = addToFreeLists(m, ptr, size);
+      prevFree = ptr;
+      justFreed = 1;
     }
+    ptr = nextAddr;
   }
+
+  memset(m->mark_bitmap_start, 0, m->bitmap_size * sizeof(uvalue_t));
+  release_free_blocks(m);
+}
+
+void memory_collect(vm_t* vm) {
+  memory_t* m = vm->memory;
+  mark_root(m, engine_get_Lb(vm));
+  mark_root(m, engine_get_Ib(vm));
+  mark_root(m, engine_get_Ob(vm));
+  mark(m);
+
+  sweep(m);
 }
 
-value_t* memory_allocate(tag_t tag, value_t size) {
-  value_t* first_try = allocate(tag, size);
+value_t* memory_allocate(vm_t* vm, tag_t tag, value_t size) {
+  memory_t* m = vm->memory;
+  value_t* first_try = allocate(m, tag, size);
   if (first_try != NULL)
     return first_try;
 
-  printf("Marking\n");
-  value_t* lb = engine_get_Lb();
-  if (lb != memory_start) mark(lb);
-  value_t* ib = engine_get_Ib();
-  if (ib != memory_start) mark(ib);
-  value_t* ob = engine_get_Ob();
-  if (ob != memory_start) mark(ob);
-
-  sweep();
+  if (vm->trace != NULL)
+    trace_collection(vm, tag, size);
+  memory_collect(vm);
 
-  value_t* second_try = allocate(tag, size);
+  value_t* second_try = allocate(m, tag, size);
   if (second_try != NULL)
     return second_try;
 
-  fail("\ncannot allocate %d words of memory, even after GC\n", size);
+  fail("cannot allocate %" PRIdVALUE " words of memory, even after GC", size);
 }
 
 value_t memory_get_block_size(value_t* block) {
@@ -1,16 +1,23 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <sys/mman.h>
 #include <assert.h>
 
 #include "memory.h"
 #include "fail.h"
+#include "arena.h"
 
 #if GC_VERSION == GC_NOFREE
 
-static value_t* memory_start = NULL;
-static value_t* memory_end = NULL;
-static value_t* free_boundary = NULL;
+struct memory {
+  value_t* memory_start;
+  value_t* memory_end;
+  value_t* free_boundary;
+  size_t memory_mapped_size;
+};
 
 #define HEADER_SIZE 1
 
@@ -32,46 +39,88 @@ char* memory_get_identity() {
   return "no GC (memory is never freed)";
 }
 
-void memory_setup(size_t total_byte_size) {
-  memory_start = calloc(total_byte_size, 1);
-  if (memory_start == NULL)
-    fail("cannot allocate %zd bytes of memory", total_byte_size);
-  memory_end = memory_start + (total_byte_size / sizeof(value_t));
+static memory_t* memory_new(vm_t* vm) {
+  assert(vm->memory == NULL);
+  vm->memory = calloc(1, sizeof(memory_t));
+  if (vm->memory == NULL)
+    fail("cannot allocate memory state");
+  return vm->memory;
+}
+
+void memory_setup(vm_t* vm, size_t total_byte_size, int huge_pages) {
+  memory_t* m = memory_new(vm);
+  m->memory_start =
+    arena_map(total_byte_size, huge_pages, &m->memory_mapped_size);
+  m->memory_end = m->memory_start + (total_byte_size / sizeof(value_t));
+}
+
+void memory_cleanup(vm_t* vm) {
+  memory_t* m = vm->memory;
+  assert(m != NULL && m->memory_start != NULL);
+  arena_unmap(m->memory_start, m->memory_mapped_size);
+  free(m);
+  vm->memory = NULL;
+}
+
+void* memory_get_start(vm_t* vm) {
+  return vm->memory->memory_start;
+}
+
+void* memory_get_end(vm_t* vm) {
+  return vm->memory->memory_end;
 }
 
-void memory_cleanup() {
-  assert(memory_start != NULL);
-  free(memory_start);
-  memory_start = memory_end = free_boundary = NULL;
+void memory_set_heap_start(vm_t* vm, void* heap_start) {
+  assert(vm->memory->free_boundary == NULL);
+  vm->memory->free_boundary = heap_start;
 }
 
-void* memory_get_start() {
-  return memory_start;
+// Snapshot support
+
+size_t memory_get_state_size() {
+  return sizeof(value_t);
 }
 
-void* memory_get_end() {
-  return memory_end;
+void memory_save_state(vm_t* vm, void* state) {
+  memory_t* m = vm->memory;
+  *(value_t*)state =
+    (value_t)((char*)m->free_boundary - (char*)m->memory_start);
 }
 
-void memory_set_heap_start(void* heap_start) {
-  assert(free_boundary == NULL);
-  free_boundary = heap_start;
+void memory_restore(vm_t* vm, int fd, off_t offset, size_t total_byte_size,
+                    const void* state) {
+  memory_t* m = memory_new(vm);
+  m->memory_start = mmap(NULL, total_byte_size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE, fd, offset);
+  if (m->memory_start == MAP_FAILED)
+    fail("cannot map %zd bytes of snapshot memory", total_byte_size);
+  m->memory_end = m->memory_start + (total_byte_size / sizeof(value_t));
+  m->memory_mapped_size = total_byte_size;
+  m->free_boundary =
+    (value_t*)((char*)m->memory_start + *(const value_t*)state);
 }
 
-value_t* memory_allocate(tag_t tag, value_t size) {
-  assert(free_boundary != NULL);
+value_t* memory_allocate(vm_t* vm, tag_t tag, value_t size) {
+  memory_t* m = vm->memory;
+  assert(m->free_boundary != NULL);
+  if (size > MAX_BLOCK_SIZE)
+    fail("block of size %" PRIdVALUE " is too large", size);
 
   const value_t total_size = size + HEADER_SIZE;
-  if (free_boundary + total_size > memory_end)
-    fail("no memory left (block of size %u requested)", size);
+  if (m->free_boundary + total_size > m->memory_end)
+    fail("no memory left (block of size %" PRIdVALUE " requested)", size);
 
-  *free_boundary = header_pack(tag, size);
-  value_t* res = free_boundary + HEADER_SIZE;
-  free_boundary += total_size;
+  *m->free_boundary = header_pack(tag, size);
+  value_t* res = m->free_boundary + HEADER_SIZE;
+  m->free_boundary += total_size;
 
   return res;
 }
 
+void memory_collect(vm_t* vm) {
+  // nothing is ever freed
+}
+
 value_t memory_get_block_size(value_t* block) {
   return header_unpack_size(block[-1]);
 }
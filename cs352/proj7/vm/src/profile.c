@@ -0,0 +1,158 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "profile.h"
+#include "fail.h"
+
+#define STACK_BUCKETS_COUNT 4096
+
+/* Distinct stacks are kept in a chained hash table, as arrays of
+   function entries, outermost first */
+typedef struct profile_stack {
+  struct profile_stack* next;
+  uint64_t count;
+  size_t depth;
+  value_t entries[];
+} profile_stack_t;
+
+struct profile {
+  char* file_name;
+
+  // function entries, sorted
+  value_t* functions;
+  size_t functions_count;
+  size_t functions_capacity;
+
+  // stack being sampled, innermost first
+  value_t* sample;
+  size_t sample_depth;
+  size_t sample_capacity;
+
+  profile_stack_t* buckets[STACK_BUCKETS_COUNT];
+};
+
+static void* grow(void* array, size_t* capacity, size_t element_size) {
+  *capacity = (*capacity == 0) ? 64 : 2 * *capacity;
+  array = realloc(array, *capacity * element_size);
+  if (array == NULL)
+    fail("cannot grow profile to %zu entries", *capacity);
+  return array;
+}
+
+profile_t* profile_new(char* file_name) {
+  profile_t* p = calloc(1, sizeof(profile_t));
+  if (p == NULL)
+    fail("cannot allocate profile");
+  p->file_name = file_name;
+  return p;
+}
+
+// index of the first function entry greater than pc
+static size_t function_upper_bound(profile_t* p, value_t pc) {
+  size_t low = 0, high = p->functions_count;
+  while (low < high) {
+    size_t middle = low + (high - low) / 2;
+    if (p->functions[middle] <= pc)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+  return low;
+}
+
+void profile_function(profile_t* p, value_t entry) {
+  size_t i = function_upper_bound(p, entry);
+  if (i > 0 && p->functions[i - 1] == entry)
+    return;
+
+  if (p->functions_count == p->functions_capacity)
+    p->functions = grow(p->functions, &p->functions_capacity,
+                        sizeof(value_t));
+  memmove(p->functions + i + 1, p->functions + i,
+          (p->functions_count - i) * sizeof(value_t));
+  p->functions[i] = entry;
+  p->functions_count += 1;
+}
+
+void profile_sample_push(profile_t* p, value_t pc) {
+  if (p->sample_depth == p->sample_capacity)
+    p->sample = grow(p->sample, &p->sample_capacity, sizeof(value_t));
+  p->sample[p->sample_depth++] = pc;
+}
+
+// Code that precedes every called function belongs to the main program,
+// whose entry is reported as -1
+static value_t function_of(profile_t* p, value_t pc) {
+  size_t i = function_upper_bound(p, pc);
+  return i == 0 ? -1 : p->functions[i - 1];
+}
+
+void profile_sample_end(profile_t* p) {
+  const size_t depth = p->sample_depth;
+  p->sample_depth = 0;
+
+  // resolve functions, outermost first
+  uint64_t hash = 14695981039346656037ull;
+  for (size_t i = 0; i < depth / 2; ++i) {
+    value_t tmp = p->sample[i];
+    p->sample[i] = p->sample[depth - 1 - i];
+    p->sample[depth - 1 - i] = tmp;
+  }
+  for (size_t i = 0; i < depth; ++i) {
+    p->sample[i] = function_of(p, p->sample[i]);
+    hash = (hash ^ (uint64_t)p->sample[i]) * 1099511628211ull;
+  }
+
+  profile_stack_t** bucket = &p->buckets[hash % STACK_BUCKETS_COUNT];
+  for (profile_stack_t* s = *bucket; s != NULL; s = s->next) {
+    if (s->depth == depth
+        && memcmp(s->entries, p->sample, depth * sizeof(value_t)) == 0) {
+      s->count += 1;
+      return;
+    }
+  }
+
+  profile_stack_t* s =
+    malloc(sizeof(profile_stack_t) + depth * sizeof(value_t));
+  if (s == NULL)
+    fail("cannot allocate profile stack");
+  s->next = *bucket;
+  s->count = 1;
+  s->depth = depth;
+  memcpy(s->entries, p->sample, depth * sizeof(value_t));
+  *bucket = s;
+}
+
+void profile_write_and_delete(profile_t* p) {
+  FILE* file = fopen(p->file_name, "w");
+  if (file == NULL)
+    fail("cannot open profile file %s", p->file_name);
+
+  int ok = 1;
+  for (size_t b = 0; b < STACK_BUCKETS_COUNT; ++b) {
+    profile_stack_t* s = p->buckets[b];
+    while (s != NULL) {
+      for (size_t i = 0; ok && i < s->depth; ++i) {
+        const char* separator = (i == 0) ? "" : ";";
+        if (s->entries[i] < 0)
+          ok = fprintf(file, "%smain", separator) >= 0;
+        else
+          ok = fprintf(file, "%sf%" PRIdVALUE, separator, s->entries[i]) >= 0;
+      }
+      ok = ok && fprintf(file, " %" PRIu64 "\n", s->count) >= 0;
+
+      profile_stack_t* next = s->next;
+      free(s);
+      s = next;
+    }
+  }
+  ok = (fclose(file) == 0) && ok;
+  if (!ok)
+    fail("error while writing profile file %s", p->file_name);
+
+  free(p->functions);
+  free(p->sample);
+  free(p);
+}
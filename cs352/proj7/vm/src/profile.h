@@ -0,0 +1,28 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stddef.h>
+#include "vmtypes.h"
+
+/* A sampling profiler of MiniScala call stacks, which writes the samples
+   as folded stacks ("main;f1272;f3072 42" lines), as used by flame graph
+   tools. Functions are named after the virtual address of their first
+   instruction. */
+typedef struct profile profile_t;
+
+/* Create a profile, to be written to file_name */
+profile_t* profile_new(char* file_name);
+
+/* Note that a function starts at the given code address */
+void profile_function(profile_t* p, value_t entry);
+
+/* Add the next code address of the sampled stack, innermost first */
+void profile_sample_push(profile_t* p, value_t pc);
+
+/* Finish the sampled stack */
+void profile_sample_end(profile_t* p);
+
+/* Write the folded stacks and release the profile */
+void profile_write_and_delete(profile_t* p);
+
+#endif // PROFILE_H
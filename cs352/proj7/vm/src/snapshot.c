@@ -0,0 +1,124 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "snapshot.h"
+#include "memory.h"
+#include "engine.h"
+#include "fail.h"
+
+#define SNAPSHOT_MAGIC 0x4D535650u /* "MSVP" */
+#define IDENTITY_LENGTH 64
+
+/* The memory image is stored page-aligned after the header and the
+   allocator state, so that it can be mapped directly on restore. All
+   addresses are stored as virtual (memory-relative) addresses. */
+typedef struct {
+  uint32_t magic;
+  uint32_t value_size;
+  char memory_identity[IDENTITY_LENGTH];
+  uint64_t memory_size;
+  uint64_t state_size;
+  uint64_t image_offset;
+  value_t pc, Lb, Ib, Ob;
+} snapshot_header_t;
+
+static size_t page_align_up(size_t value) {
+  const size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+  return (value + page_size - 1) / page_size * page_size;
+}
+
+static value_t addr_p_to_v(vm_t* vm, void* p_addr) {
+  return (value_t)((char*)p_addr - (char*)memory_get_start(vm));
+}
+
+static void* addr_v_to_p(vm_t* vm, value_t v_addr) {
+  return (char*)memory_get_start(vm) + v_addr;
+}
+
+void snapshot_save(vm_t* vm, char* file_name) {
+  char* memory_start = memory_get_start(vm);
+  char* memory_end = memory_get_end(vm);
+
+  snapshot_header_t header;
+  memset(&header, 0, sizeof(header));
+  header.magic = SNAPSHOT_MAGIC;
+  header.value_size = sizeof(value_t);
+  strncpy(header.memory_identity, memory_get_identity(), IDENTITY_LENGTH - 1);
+  header.memory_size = (uint64_t)(memory_end - memory_start);
+  header.state_size = memory_get_state_size();
+  header.image_offset = page_align_up(sizeof(header) + header.state_size);
+  header.pc = addr_p_to_v(vm, engine_get_pc(vm));
+  header.Lb = addr_p_to_v(vm, engine_get_Lb(vm));
+  header.Ib = addr_p_to_v(vm, engine_get_Ib(vm));
+  header.Ob = addr_p_to_v(vm, engine_get_Ob(vm));
+
+  void* state = calloc(1, header.state_size);
+  if (state == NULL)
+    fail("cannot allocate %zd bytes for the snapshot", header.state_size);
+  memory_save_state(vm, state);
+
+  FILE* file = fopen(file_name, "wb");
+  if (file == NULL)
+    fail("cannot open snapshot file %s", file_name);
+
+  const size_t padding =
+    header.image_offset - sizeof(header) - header.state_size;
+  int ok = fwrite(&header, sizeof(header), 1, file) == 1
+    && fwrite(state, header.state_size, 1, file) == 1;
+  for (size_t i = 0; ok && i < padding; ++i)
+    ok = fputc(0, file) != EOF;
+  ok = ok && fwrite(memory_start, header.memory_size, 1, file) == 1;
+  ok = (fclose(file) == 0) && ok;
+  free(state);
+
+  if (!ok)
+    fail("error while writing snapshot file %s", file_name);
+}
+
+void snapshot_restore(vm_t* vm, char* file_name) {
+  int fd = open(file_name, O_RDONLY);
+  if (fd < 0)
+    fail("cannot open snapshot file %s", file_name);
+
+  snapshot_header_t header;
+  if (read(fd, &header, sizeof(header)) != (ssize_t)sizeof(header)
+      || header.magic != SNAPSHOT_MAGIC)
+    fail("invalid snapshot file %s", file_name);
+  if (header.value_size != sizeof(value_t)
+      || strncmp(header.memory_identity, memory_get_identity(),
+                 IDENTITY_LENGTH - 1) != 0
+      || header.state_size != memory_get_state_size())
+    fail("snapshot file %s was saved by an incompatible vm", file_name);
+
+  /* Mapping past the end of the file would only fault on first access */
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) < 0)
+    fail("cannot stat snapshot file %s", file_name);
+  const uint64_t file_size = (uint64_t)file_stat.st_size;
+  if (header.image_offset > file_size
+      || header.memory_size > file_size - header.image_offset)
+    fail("truncated snapshot file %s", file_name);
+
+  void* state = malloc(header.state_size);
+  if (state == NULL)
+    fail("cannot allocate %zd bytes for the snapshot", header.state_size);
+  if (read(fd, state, header.state_size) != (ssize_t)header.state_size)
+    fail("invalid snapshot file %s", file_name);
+
+  memory_restore(vm, fd, (off_t)header.image_offset, header.memory_size,
+                 state);
+  free(state);
+  close(fd);
+
+  engine_setup(vm);
+  engine_set_Lb(vm, addr_v_to_p(vm, header.Lb));
+  engine_set_Ib(vm, addr_v_to_p(vm, header.Ib));
+  engine_set_Ob(vm, addr_v_to_p(vm, header.Ob));
+  engine_set_pc(vm, addr_v_to_p(vm, header.pc));
+}
@@ -0,0 +1,14 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "vmtypes.h"
+#include "vm.h"
+
+/* Write the memory image, allocator state, registers and pc to a file */
+void snapshot_save(vm_t* vm, char* file_name);
+
+/* Map a snapshot file as the VM memory, then restore the allocator state,
+   registers and pc, so that engine_run resumes where the snapshot was saved */
+void snapshot_restore(vm_t* vm, char* file_name);
+
+#endif // SNAPSHOT_H
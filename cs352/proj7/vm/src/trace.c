@@ -0,0 +1,162 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "trace.h"
+#include "memory.h"
+#include "engine.h"
+#include "fail.h"
+
+#define TRACE_MAGIC "MSTRACE"
+#define IDENTITY_LENGTH 64
+
+/* A trace is a text file: a header line with the value size and memory
+   size, a line with the memory identity, then one line per event, in
+   execution order:
+
+     i <byte>                   a byte read by BREA (-1 at end of input)
+     g <allocation> <tag> <size>  a collection triggered by the given
+                                  allocation (counted from 1)
+
+   Replaying with the same program and memory size therefore runs the
+   exact same execution. The recorded collections are started by the
+   replay itself, so that a change to the memory module that would
+   collect at other points still replays them: the memory only starts a
+   collection of its own when an allocation cannot be served without
+   one, and those are counted and reported. */
+
+typedef struct {
+  char kind;                    /* 'i', 'g', or 0 past the last event */
+  long long a, b, c;
+} trace_event_t;
+
+struct trace {
+  FILE* file;
+  char* file_name;
+  int replay;
+  uint64_t allocation_count;
+  uint64_t extra_collections;   /* not in the trace, when replaying */
+  trace_event_t next;           /* next event to replay */
+};
+
+static trace_t* trace_new(vm_t* vm, char* file_name, int replay) {
+  if (vm->trace != NULL)
+    fail("a trace is already being recorded or replayed");
+  trace_t* t = calloc(1, sizeof(trace_t));
+  if (t == NULL)
+    fail("cannot allocate trace");
+  t->file = fopen(file_name, replay ? "r" : "w");
+  if (t->file == NULL)
+    fail("cannot open trace file %s", file_name);
+  t->file_name = file_name;
+  t->replay = replay;
+  vm->trace = t;
+  return t;
+}
+
+static size_t memory_size(vm_t* vm) {
+  return (size_t)((char*)memory_get_end(vm) - (char*)memory_get_start(vm));
+}
+
+static void read_next_event(trace_t* t) {
+  char line[100];
+  t->next.kind = 0;
+  if (fgets(line, sizeof(line), t->file) == NULL)
+    return;
+
+  char kind;
+  int count = sscanf(line, "%c %lld %lld %lld", &kind, &t->next.a,
+                     &t->next.b, &t->next.c);
+  if (!(kind == 'i' && count == 2) && !(kind == 'g' && count == 4))
+    fail("invalid trace file %s", t->file_name);
+  t->next.kind = kind;
+}
+
+void trace_record(vm_t* vm, char* file_name) {
+  trace_t* t = trace_new(vm, file_name, 0);
+  fprintf(t->file, "%s %zu %zu\n%s\n", TRACE_MAGIC, sizeof(value_t),
+          memory_size(vm), memory_get_identity());
+}
+
+void trace_replay(vm_t* vm, char* file_name) {
+  trace_t* t = trace_new(vm, file_name, 1);
+
+  char magic[16];
+  size_t value_size, recorded_memory_size;
+  char identity[IDENTITY_LENGTH];
+  if (fscanf(t->file, "%15s %zu %zu ", magic, &value_size,
+             &recorded_memory_size) != 3
+      || strcmp(magic, TRACE_MAGIC) != 0
+      || fgets(identity, sizeof(identity), t->file) == NULL)
+    fail("invalid trace file %s", file_name);
+  identity[strcspn(identity, "\n")] = '\0';
+
+  if (value_size != sizeof(value_t)
+      || strcmp(identity, memory_get_identity()) != 0)
+    fail("trace file %s was recorded by an incompatible vm", file_name);
+  if (recorded_memory_size != memory_size(vm))
+    fail("trace file %s was recorded with a memory size of %zu bytes",
+         file_name, recorded_memory_size);
+
+  read_next_event(t);
+}
+
+void trace_close(vm_t* vm) {
+  trace_t* t = vm->trace;
+  // a run stopped by a limit or an error legitimately leaves events
+  // unreplayed
+  if (t->replay && t->next.kind != 0 && vm_get_status(vm) == vm_halted)
+    fail("replay of %s diverged: the program halted before the end of "
+         "the trace", t->file_name);
+  if (t->extra_collections > 0)
+    fprintf(stderr, "replay of %s needed %" PRIu64 " collections not in "
+            "the trace\n", t->file_name, t->extra_collections);
+  if (fclose(t->file) != 0 && !t->replay)
+    fail("error while writing trace file %s", t->file_name);
+  free(t);
+  vm->trace = NULL;
+}
+
+value_t trace_read_byte(vm_t* vm) {
+  trace_t* t = vm->trace;
+  if (t->replay) {
+    if (t->next.kind != 'i')
+      fail("replay of %s diverged: unexpected input read after allocation "
+           "%" PRIu64, t->file_name, t->allocation_count);
+    value_t byte = (value_t)t->next.a;
+    read_next_event(t);
+    return byte;
+  }
+
+  uint8_t byte;
+  size_t read = fread(&byte, sizeof(byte), 1, vm->in);
+  value_t result = (read == sizeof(byte) ? byte : -1);
+  fprintf(t->file, "i %" PRIdVALUE "\n", result);
+  return result;
+}
+
+void trace_allocation(vm_t* vm, tag_t tag, value_t size) {
+  trace_t* t = vm->trace;
+  t->allocation_count += 1;
+  if (!t->replay || t->next.kind != 'g'
+      || (uint64_t)t->next.a != t->allocation_count)
+    return;
+
+  if (t->next.b != (long long)tag || t->next.c != (long long)size)
+    fail("replay of %s diverged: unexpected allocation %" PRIu64,
+         t->file_name, t->allocation_count);
+  read_next_event(t);
+  memory_collect(vm);
+}
+
+void trace_collection(vm_t* vm, tag_t tag, value_t size) {
+  trace_t* t = vm->trace;
+  if (t->replay) {
+    t->extra_collections += 1;
+    return;
+  }
+
+  fprintf(t->file, "g %" PRIu64 " %u %" PRIdVALUE "\n",
+          t->allocation_count, (unsigned int)tag, size);
+}
@@ -0,0 +1,29 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "vmtypes.h"
+#include "memory.h"
+#include "vm.h"
+
+/* Record the bytes read by BREA and the points at which the memory is
+   collected to a trace file */
+void trace_record(vm_t* vm, char* file_name);
+
+/* Replay a trace file: BREA reads its bytes from the trace, and the
+   memory is collected at the allocations where it was recorded */
+void trace_replay(vm_t* vm, char* file_name);
+
+/* Finish recording or replaying, and release the trace */
+void trace_close(vm_t* vm);
+
+/* Read a byte for BREA, or -1 at the end of the input */
+value_t trace_read_byte(vm_t* vm);
+
+/* Count an allocation request, before it is passed to the memory. When
+   replaying, collect the memory if the trace says this allocation did */
+void trace_allocation(vm_t* vm, tag_t tag, value_t size);
+
+/* Note that the memory starts a collection to serve an allocation */
+void trace_collection(vm_t* vm, tag_t tag, value_t size);
+
+#endif // TRACE_H
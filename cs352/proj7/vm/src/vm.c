@@ -0,0 +1,131 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdalign.h>
+#include <assert.h>
+
+#include "vm.h"
+#include "memory.h"
+#include "engine.h"
+#include "snapshot.h"
+#include "trace.h"
+#include "fail.h"
+
+// Memory/size alignment
+
+static size_t align_down(size_t value, size_t align) {
+  assert(align > 0 && (align & (align - 1)) == 0); /* check power of 2 */
+  return value & ~(align - 1);
+}
+
+static void* align_up(void* address, size_t align) {
+  assert(align > 0 && (align & (align - 1)) == 0); /* check power of 2 */
+  uintptr_t int_address = (uintptr_t)address;
+  uintptr_t aligned_address = (int_address + align - 1) & ~(align - 1);
+  return (void*)aligned_address;
+}
+
+// ASM file loading
+
+static void load_file(vm_t* vm, char* file_name, instr_t** instr_ptr) {
+  FILE* file = fopen(file_name, "r");
+  if (file == NULL)
+    fail("cannot open file %s", file_name);
+
+  char line[1000];
+  while (fgets(line, sizeof(line), file) != NULL) {
+    instr_t instr;
+    int read_count = sscanf(line, "%8x", &instr);
+    if (read_count != 1)
+      fail("error while reading file %s", file_name);
+
+    engine_emit(vm, instr, instr_ptr);
+  }
+
+  fclose(file);
+}
+
+// VM instances
+
+static vm_t* vm_alloc(void) {
+  vm_t* vm = calloc(1, sizeof(vm_t));
+  if (vm == NULL)
+    fail("cannot allocate vm");
+  vm->in = stdin;
+  vm->out = stdout;
+  return vm;
+}
+
+vm_t* vm_new(char* asm_file_name, size_t memory_size, int huge_pages) {
+  const int value_align = alignof(value_t);
+
+  vm_t* vm = vm_alloc();
+  memory_setup(vm, align_down(memory_size, value_align), huge_pages);
+  engine_setup(vm);
+
+  instr_t* instr_ptr = memory_get_start(vm);
+  load_file(vm, asm_file_name, &instr_ptr);
+  engine_verify(vm, instr_ptr);
+  memory_set_heap_start(vm, align_up(instr_ptr, value_align));
+
+  return vm;
+}
+
+vm_t* vm_new_from_snapshot(char* snapshot_file_name) {
+  vm_t* vm = vm_alloc();
+  snapshot_restore(vm, snapshot_file_name);
+  return vm;
+}
+
+void vm_snapshot_at_input(vm_t* vm, char* snapshot_file_name) {
+  engine_snapshot_at_input(vm, snapshot_file_name);
+}
+
+void vm_record_trace(vm_t* vm, char* trace_file_name) {
+  trace_record(vm, trace_file_name);
+}
+
+void vm_replay_trace(vm_t* vm, char* trace_file_name) {
+  trace_replay(vm, trace_file_name);
+}
+
+void vm_set_limits(vm_t* vm, uint64_t max_instructions, double max_seconds) {
+  engine_set_limits(vm, max_instructions, max_seconds);
+}
+
+void vm_profile(vm_t* vm, char* profile_file_name) {
+  engine_profile(vm, profile_file_name);
+}
+
+// Errors during a run jump back here, leaving the other instances of
+// the process running. The engine and memory of the failed instance may
+// be left halfway through an instruction or a collection, so it is only
+// fit to be deleted.
+
+value_t vm_run(vm_t* vm) {
+  if (vm->failed)
+    return 0;
+  if (setjmp(vm->on_fail) != 0) {
+    vm->failed = 1;
+    return 0;
+  }
+  fail_catch(&vm->on_fail, vm->error, sizeof(vm->error));
+  value_t halt_code = engine_run(vm);
+  fail_catch(NULL, NULL, 0);
+  return halt_code;
+}
+
+vm_status_t vm_get_status(vm_t* vm) {
+  return vm->failed ? vm_failed : engine_get_status(vm);
+}
+
+const char* vm_get_error(vm_t* vm) {
+  return vm->failed ? vm->error : NULL;
+}
+
+void vm_delete(vm_t* vm) {
+  if (vm->trace != NULL)
+    trace_close(vm);
+  engine_cleanup(vm);
+  memory_cleanup(vm);
+  free(vm);
+}
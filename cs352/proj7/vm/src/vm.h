@@ -0,0 +1,74 @@
+#ifndef VM_H
+#define VM_H
+
+#include <stdio.h>
+#include <setjmp.h>
+#include "vmtypes.h"
+
+typedef struct engine engine_t;
+typedef struct memory memory_t;
+typedef struct trace trace_t;
+
+/* How a run ended */
+typedef enum {
+  vm_halted,                    /* the program executed HALT */
+  vm_out_of_instructions,       /* the instruction budget was exhausted */
+  vm_out_of_time,               /* the deadline passed */
+  vm_failed                     /* an error stopped the run, see vm_get_error */
+} vm_status_t;
+
+/* A virtual machine instance. Instances share no state, so distinct
+   instances can run concurrently, each on its own thread. */
+typedef struct vm {
+  engine_t* engine;
+  memory_t* memory;
+  FILE* in;                     /* input stream of BREA */
+  FILE* out;                    /* output stream of BWRI */
+  trace_t* trace;               /* trace being recorded or replayed */
+  jmp_buf on_fail;              /* where errors during a run jump to */
+  int failed;                   /* whether a run was stopped by an error */
+  char error[256];              /* message of that error */
+} vm_t;
+
+/* Create a VM with memory_size bytes of memory (code and heap), and load
+   the assembly file into it. I/O defaults to stdin and stdout. */
+vm_t* vm_new(char* asm_file_name, size_t memory_size, int huge_pages);
+
+/* Create a VM from a snapshot file, ready to resume where it was saved */
+vm_t* vm_new_from_snapshot(char* snapshot_file_name);
+
+/* Save a snapshot of the VM just before the first byte of input is read */
+void vm_snapshot_at_input(vm_t* vm, char* snapshot_file_name);
+
+/* Record the input and the collections of the run to a trace file */
+void vm_record_trace(vm_t* vm, char* trace_file_name);
+
+/* Replay a trace file: the input is read from the trace instead of the
+   input stream, and the run fails if it diverges from the recorded one */
+void vm_replay_trace(vm_t* vm, char* trace_file_name);
+
+/* Limit each run to max_instructions instructions and max_seconds of
+   wall-clock time (0 for no limit). Limits are only checked on jumps and
+   calls, so they can be overshot by one straight-line sequence. */
+void vm_set_limits(vm_t* vm, uint64_t max_instructions, double max_seconds);
+
+/* Sample the MiniScala call stack periodically, and write the samples to
+   a file in folded-stack format when the VM is deleted */
+void vm_profile(vm_t* vm, char* profile_file_name);
+
+/* Run the program until it halts, and return its halt code. If a limit
+   stops the run first, 0 is returned, and vm_run resumes the program.
+   If an error (such as heap exhaustion) stops it, 0 is returned too, but
+   the VM cannot run again and can only be deleted. */
+value_t vm_run(vm_t* vm);
+
+/* Tell how the last run ended */
+vm_status_t vm_get_status(vm_t* vm);
+
+/* Tell which error stopped the run, when its status is vm_failed */
+const char* vm_get_error(vm_t* vm);
+
+/* Destroy a VM and release its memory */
+void vm_delete(vm_t* vm);
+
+#endif // VM_H
@@ -3,11 +3,29 @@
 
 #include <limits.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <assert.h>
 
+/* Width of values in bits: 32 (default) or 64. 64-bit values allow
+   blocks and heaps larger than the 32-bit header layout can describe. */
+#ifndef VALUE_WIDTH
+#define VALUE_WIDTH 32
+#endif
+
 typedef uint32_t instr_t;       /* instruction */
+#if VALUE_WIDTH == 64
+typedef int64_t value_t;        /* value (signed int / non-negative pointer) */
+typedef uint64_t uvalue_t;      /* unsigned value (for bitmap only) */
+#define VALUE_MAX INT64_MAX
+#define PRIdVALUE PRId64
+#elif VALUE_WIDTH == 32
 typedef int32_t value_t;        /* value (signed int / non-negative pointer) */
 typedef uint32_t uvalue_t;      /* unsigned value (for bitmap only) */
+#define VALUE_MAX INT32_MAX
+#define PRIdVALUE PRId32
+#else
+#error "VALUE_WIDTH must be 32 or 64"
+#endif
 typedef uint_fast8_t reg_id_t;  /* register identity */
 
 static_assert(sizeof(value_t) == sizeof(uvalue_t),